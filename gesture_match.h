@@ -0,0 +1,629 @@
+// Gesture matching core: sample types, normalization, the tolerance, DTW and
+// correlation matchers, the feature pre-filter and resampling. Nothing in here
+// touches hardware or global sketch state, so it builds unchanged for the
+// board (from main.cpp) and natively (tools/gesture_replay.cpp) for offline
+// tuning. The includer defines SAMPLE_RATE_HZ, SEQUENCE_LENGTH,
+// SAMPLES_FOR_MS(), USE_RESAMPLING and RESAMPLE_LENGTH first; every setting
+// below can be overridden with -D on either side.
+#ifndef GESTURE_MATCH_H
+#define GESTURE_MATCH_H
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+template <typename T> T min(T a, T b) { return b < a ? b : a; }
+template <typename T> T max(T a, T b) { return a < b ? b : a; }
+#endif
+
+#ifndef MATCH_THRESHOLD
+#define MATCH_THRESHOLD 0.85  // Fraction of elements that must match to unlock
+#endif
+#ifndef MATCH_TOLERANCE
+#define MATCH_TOLERANCE 0.3  // Max normalized difference for an element to match
+#endif
+// Sakoe-Chiba band half width in samples. Resampled sequences are a fixed
+// length whatever the capture rate, so there it is a share of that length.
+// At least 1 either way, since featureDistance() divides by it.
+#ifndef DTW_BAND_RADIUS
+#if USE_RESAMPLING
+#define DTW_BAND_RADIUS (RESAMPLE_LENGTH < 10 ? 1 : RESAMPLE_LENGTH / 10)
+#else
+#define DTW_BAND_RADIUS (SAMPLES_FOR_MS(100) < 1 ? 1 : SAMPLES_FOR_MS(100))
+#endif
+#endif
+#ifndef DTW_DIFF_SCALE
+#define DTW_DIFF_SCALE 1.0  // Mean normalized per-axis difference that scores 0
+#endif
+
+// Feature pre-filter run before DTW and NCC. A template is skipped when the
+// attempt's summary differs from it on any axis by more than these, in
+// normalized units. Set so the replay tool's sample logs see no genuine pair
+// rejected, resampled or not; check its pre-filter line after changing them.
+#ifndef FEATURE_MEAN_TOLERANCE
+#define FEATURE_MEAN_TOLERANCE 0.7
+#endif
+#ifndef FEATURE_SPREAD_TOLERANCE
+#define FEATURE_SPREAD_TOLERANCE 0.7
+#endif
+#ifndef FEATURE_CROSSING_TOLERANCE
+#define FEATURE_CROSSING_TOLERANCE 3  // Swings across the axis mean
+#endif
+#ifndef FEATURE_HYSTERESIS
+#define FEATURE_HYSTERESIS 0.2  // Distance from the mean that counts as a swing
+#endif
+
+// Set to 0 to store and compare samples as float m/s^2. The default stores
+// them as int16 Q7.8 m/s^2 (1/256 m/s^2 resolution, +/-128 m/s^2 range), which
+// halves sequence RAM and keeps the comparator free of float math.
+#ifndef USE_FIXED_POINT
+#define USE_FIXED_POINT 1
+#endif
+
+// Set to 0 to keep Cortex-M4 builds (the Bluefruit) on the portable
+// comparator kernel instead of the SIMD one. Other cores always use it.
+#ifndef USE_DSP_KERNEL
+#define USE_DSP_KERNEL 1
+#endif
+
+#if USE_FIXED_POINT
+typedef int16_t sample_t;
+typedef int32_t norm_scale_t;  // Live-side reciprocal, see liveScale()
+typedef int32_t sample_sum_t;  // Sums of several samples
+#define SAMPLE_UNITS(value) ((sample_sum_t)((value) * (1 << SAMPLE_FRAC_BITS)))
+#define SAMPLE_FRAC_BITS 8
+#define SAMPLE_MAX 32767  // Clamp to +/-32767 so products of two samples fit in int32
+#define NORM_SHIFT 14  // Normalized samples are Q1.14, +/-1.0 = +/-16384
+#define NORM_ONE (1 << NORM_SHIFT)
+typedef uint32_t dtw_cost_t;
+#define DTW_COST_SHIFT 4  // Q1.14 differences to Q.10 costs, a whole cell fits in 13 bits
+#define DTW_INFINITY 0xFFFFFFFFUL
+#else
+typedef float sample_t;
+typedef float norm_scale_t;
+typedef float sample_sum_t;
+#define SAMPLE_UNITS(value) (value)
+#define NORM_ONE 1.0
+typedef float dtw_cost_t;
+#define DTW_INFINITY 1e30
+#endif
+
+// Summary of a normalized gesture, cheap to compare before running a matcher
+struct GestureFeatures {
+    sample_t mean[3];
+    sample_t spread[3];  // Mean absolute deviation from the axis mean
+    uint8_t crossings[3];  // Swings across the axis mean
+    uint8_t length;
+};
+
+// Live-side scale for a given peak, so normalizeLive() needs one multiply and
+// no division. peak must be non-zero.
+inline norm_scale_t liveScale(sample_t peak) {
+#if USE_FIXED_POINT
+    // peak <= 32767, so the reciprocal is at least 2^15 and
+    // |value| * reciprocal <= 2^30
+    return (1L << 30) / peak;
+#else
+    return 1.0 / peak;
+#endif
+}
+
+// Scales a live sample to the template's NORM_ONE range
+inline sample_t normalizeLive(sample_t value, norm_scale_t scale) {
+#if USE_FIXED_POINT
+    return ((int32_t)value * scale) >> (30 - NORM_SHIFT);
+#else
+    return value * scale;
+#endif
+}
+
+// Enrolled templates are kept as int8 with NORM_ONE as TEMPLATE_ONE, the
+// same values the persisted slots hold, for half the RAM of sample_t (a
+// quarter in float builds). The matchers decode each value as they read it,
+// so no full-width copy of a template is ever made. At 1/127 the step is far
+// below any useful MATCH_TOLERANCE. Delta coding would not shrink an 8-bit
+// value further and would cost DTW its random access into the band.
+typedef int8_t template_t;
+#define TEMPLATE_ONE 127
+#if USE_FIXED_POINT
+#define TEMPLATE_STEP 129  // NORM_ONE / TEMPLATE_ONE, so TEMPLATE_ONE decodes to 16383
+#endif
+
+inline template_t encodeSample(sample_t value) {
+#if USE_FIXED_POINT
+    int32_t scaled = (int32_t)value * TEMPLATE_ONE;
+    scaled = (scaled + (scaled < 0 ? -NORM_ONE / 2 : NORM_ONE / 2)) / NORM_ONE;
+#else
+    long scaled = lround(value * TEMPLATE_ONE);
+#endif
+    return scaled > TEMPLATE_ONE ? TEMPLATE_ONE : scaled < -TEMPLATE_ONE ? -TEMPLATE_ONE : scaled;
+}
+
+inline sample_t decodeSample(template_t value) {
+#if USE_FIXED_POINT
+    return value * TEMPLATE_STEP;
+#else
+    return value * (1.0f / TEMPLATE_ONE);
+#endif
+}
+
+// Lets code that reads live sequences and templates alike take either
+inline sample_t decodeSample(sample_t value) {
+    return value;
+}
+
+// Stores a normalized sequence as a template
+inline void encodeSequence(const sample_t* sequence, int length, template_t* dest) {
+    for (int i = 0; i < length * 3; i++) {
+        dest[i] = encodeSample(sequence[i]);
+    }
+}
+
+// Moves a template 1/2^shift of the way towards a live sequence of the same
+// length, in place; the live side is normalized by scale as it is read.
+// Shifts that the int8 step can't hold round away, so a value only follows
+// a difference of more than 2^(shift-1) steps.
+inline void blendTemplate(template_t* stored, const sample_t* live, int length, norm_scale_t scale, int shift) {
+    for (int i = 0; i < length * 3; i++) {
+        sample_t current = decodeSample(stored[i]);
+        sample_t target = normalizeLive(live[i], scale);
+        stored[i] = encodeSample(current + (target - current) / (1 << shift));
+    }
+}
+
+// Scales a sequence in place so its largest |axis|, peak, becomes NORM_ONE.
+// A zero peak leaves it as it is; the matchers score that as a mismatch.
+inline void normalizeSequence(sample_t* sequence, int length, sample_t peak) {
+    if (peak == 0) {
+        return;
+    }
+    for(int i = 0; i < length * 3; i++) {
+#if USE_FIXED_POINT
+        sequence[i] = ((int32_t)sequence[i] << NORM_SHIFT) / peak;
+#else
+        sequence[i] = sequence[i] / peak;
+#endif
+    }
+}
+
+#if USE_FIXED_POINT
+#define NORM_TOLERANCE (int32_t)(NORM_ONE * MATCH_TOLERANCE)
+#else
+#define NORM_TOLERANCE MATCH_TOLERANCE
+#endif
+
+#if USE_FIXED_POINT
+#define NORM_UNITS(value) ((int32_t)(NORM_ONE * (value)))
+#else
+#define NORM_UNITS(value) (value)
+#endif
+
+inline sample_sum_t absSum(sample_sum_t value) {
+    return value < 0 ? -value : value;
+}
+
+// Summarizes a live sequence or a template after scaling it by
+// normalizeLive(value, scale). liveScale(NORM_ONE) leaves an already
+// normalized template as it is.
+template <typename Value>
+void computeFeatures(GestureFeatures& features, const Value* sequence, int length, norm_scale_t scale) {
+    features.length = length;
+    for (int a = 0; a < 3; a++) {
+        features.mean[a] = 0;
+        features.spread[a] = 0;
+        features.crossings[a] = 0;
+    }
+    if (length <= 0) {
+        return;
+    }
+
+    for (int a = 0; a < 3; a++) {
+        sample_sum_t sum = 0;
+        for (int i = 0; i < length; i++) {
+            sum += normalizeLive(decodeSample(sequence[i * 3 + a]), scale);
+        }
+        sample_t mean = sum / length;
+
+        sample_sum_t deviation = 0;
+        int side = 0;  // Which side of the mean the last swing ended on
+        for (int i = 0; i < length; i++) {
+            sample_sum_t offset = (sample_sum_t)normalizeLive(decodeSample(sequence[i * 3 + a]), scale) - mean;
+            deviation += absSum(offset);
+            if (offset > NORM_UNITS(FEATURE_HYSTERESIS) && side <= 0) {
+                features.crossings[a] += side < 0;
+                side = 1;
+            } else if (offset < -NORM_UNITS(FEATURE_HYSTERESIS) && side >= 0) {
+                features.crossings[a] += side > 0;
+                side = -1;
+            }
+        }
+        features.mean[a] = mean;
+        features.spread[a] = deviation / length;
+    }
+}
+
+// False when the attempt is so far from the template that the full matcher
+// can't be expected to pass it. Lengths aren't compared; that is up to the
+// caller, since only some engines care.
+inline bool featuresCompatible(const GestureFeatures& live, const GestureFeatures& stored) {
+    for (int a = 0; a < 3; a++) {
+        if (absSum((sample_sum_t)live.mean[a] - stored.mean[a]) > NORM_UNITS(FEATURE_MEAN_TOLERANCE)
+            || absSum((sample_sum_t)live.spread[a] - stored.spread[a]) > NORM_UNITS(FEATURE_SPREAD_TOLERANCE)
+            || abs((int)live.crossings[a] - stored.crossings[a]) > FEATURE_CROSSING_TOLERANCE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sum of the feature differences, each relative to its tolerance, so the most
+// similar template can be tried first
+inline float featureDistance(const GestureFeatures& live, const GestureFeatures& stored) {
+    float distance = (float)abs((int)live.length - stored.length) / DTW_BAND_RADIUS;
+    for (int a = 0; a < 3; a++) {
+        distance += fabs((float)live.mean[a] - stored.mean[a]) / NORM_UNITS(FEATURE_MEAN_TOLERANCE);
+        distance += fabs((float)live.spread[a] - stored.spread[a]) / NORM_UNITS(FEATURE_SPREAD_TOLERANCE);
+        distance += (float)abs((int)live.crossings[a] - stored.crossings[a]) / FEATURE_CROSSING_TOLERANCE;
+    }
+    return distance;
+}
+
+#if USE_FIXED_POINT
+// diff lies strictly inside +/-NORM_TOLERANCE exactly when diff + NORM_BIAS,
+// taken as unsigned, is below NORM_WINDOW, so the test is one compare
+#define NORM_BIAS (NORM_TOLERANCE - 1)
+#define NORM_WINDOW (uint32_t)(2 * NORM_TOLERANCE - 1)
+#endif
+
+inline bool elementMatches(sample_t normalizedRecorded, sample_t stored) {
+#if USE_FIXED_POINT
+    return (uint32_t)((int32_t)normalizedRecorded - stored + NORM_BIAS) < NORM_WINDOW;
+#else
+    return fabs(normalizedRecorded - stored) < NORM_TOLERANCE;
+#endif
+}
+
+// A larger live peak only pulls a normalized value towards 0, so an element
+// stays a miss for good if the whole span between 0 and its current value
+// lies outside the tolerance window around the stored value.
+inline bool elementHardMiss(sample_t normalizedRecorded, sample_t stored) {
+    sample_t low = min(normalizedRecorded, (sample_t)0);
+    sample_t high = max(normalizedRecorded, (sample_t)0);
+    return stored - NORM_TOLERANCE >= high || stored + NORM_TOLERANCE <= low;
+}
+
+#if USE_FIXED_POINT && USE_DSP_KERNEL && defined(__ARM_FEATURE_DSP)
+// Cortex-M4 kernel, two elements per step on packed halfwords using the
+// CMSIS core intrinsics. SMULWB/SMULWT scale one halfword each by the 32-bit
+// reciprocal, exactly normalizeLive(); the rest is lane-wise elementMatches(),
+// with USUB16 setting a GE flag for every lane that misses and SEL turning
+// the others into a count of 1. CMSIS has no intrinsic for the multiplies.
+// Each template pair is decoded and packed the same way.
+inline int32_t scaleBottom(norm_scale_t scale, uint32_t pair) {
+    int32_t result;
+    __asm__("smulwb %0, %1, %2" : "=r"(result) : "r"(scale), "r"(pair));
+    return result;
+}
+
+inline int32_t scaleTop(norm_scale_t scale, uint32_t pair) {
+    int32_t result;
+    __asm__("smulwt %0, %1, %2" : "=r"(result) : "r"(scale), "r"(pair));
+    return result;
+}
+
+inline uint32_t loadPair(const sample_t* values) {
+    uint32_t pair;
+    memcpy(&pair, values, sizeof(pair));  // Sequences are only halfword aligned
+    return pair;
+}
+
+inline int countMatches(const sample_t* recorded, const template_t* stored, int length, norm_scale_t scale) {
+    const uint32_t bias = (uint16_t)NORM_BIAS * 0x00010001UL;
+    const uint32_t window = NORM_WINDOW * 0x00010001UL;
+    uint32_t counts = 0;  // One count per lane, neither can pass 16 bits
+    int count = length * 3;
+    int i = 0;
+    for (; i + 1 < count; i += 2) {
+        uint32_t pair = loadPair(recorded + i);
+        uint32_t live = __PKHBT(scaleBottom(scale, pair), scaleTop(scale, pair), 16);
+        uint32_t storedPair = __PKHBT(decodeSample(stored[i]), decodeSample(stored[i + 1]), 16);
+        uint32_t diff = __SADD16(__QSUB16(live, storedPair), bias);
+        __USUB16(diff, window);
+        counts += __SEL(0, 0x00010001UL);
+    }
+    int matches = (counts & 0xFFFF) + (counts >> 16);
+    if (i < count) {
+        matches += elementMatches(normalizeLive(recorded[i], scale), decodeSample(stored[i]));
+    }
+    return matches;
+}
+#else
+// Portable kernel, unrolled by the 3-axis stride with the per-element test
+// folded into the count instead of branching on it
+inline int countMatches(const sample_t* recorded, const template_t* stored, int length, norm_scale_t scale) {
+    int matches = 0;
+    for (int i = 0; i < length * 3; i += 3) {
+        matches += elementMatches(normalizeLive(recorded[i], scale), decodeSample(stored[i]));
+        matches += elementMatches(normalizeLive(recorded[i + 1], scale), decodeSample(stored[i + 1]));
+        matches += elementMatches(normalizeLive(recorded[i + 2], scale), decodeSample(stored[i + 2]));
+    }
+    return matches;
+}
+#endif
+
+// Fraction of elements where the normalized live and stored values are within
+// tolerance. stored is a template from encodeSequence(); the live side is
+// scaled by a single reciprocal of recordedPeak, so there is one multiply and
+// no division per element.
+inline float compareSequences(sample_t* recorded, const template_t* stored, int length, sample_t recordedPeak, sample_t storedPeak) {
+    if (length <= 0 || recordedPeak == 0 || storedPeak == 0) {
+        return 0;
+    }
+
+    int matchCount = countMatches(recorded, stored, length, liveScale(recordedPeak));
+    return (float)matchCount / (length * 3);
+}
+
+// =============== DTW MATCHER =========================
+// Dynamic time warping with a Sakoe-Chiba band of DTW_BAND_RADIUS samples and
+// the symmetric step weights (diagonal steps cost twice), so the total divided
+// by recordedLength + length is the mean cell cost along the warping path.
+// Only two band-wide rows are kept, which bounds both memory and run time to
+// (2 * DTW_BAND_RADIUS + 1) cells per live sample.
+
+// Working memory of one DTW comparison: the two rows of the cost matrix,
+// holding only the cells inside the band
+struct DtwScratch {
+    dtw_cost_t rows[2][2 * DTW_BAND_RADIUS + 1];
+};
+
+// Sum of per-axis differences between a normalized live sample and a template sample
+inline dtw_cost_t dtwCellCost(const sample_t* live, const template_t* stored) {
+    dtw_cost_t cost = 0;
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        int32_t diff = (int32_t)live[a] - decodeSample(stored[a]);
+        cost += (uint32_t)(diff < 0 ? -diff : diff) >> DTW_COST_SHIFT;
+#else
+        cost += fabs(live[a] - decodeSample(stored[a]));
+#endif
+    }
+    return cost;
+}
+
+inline dtw_cost_t dtwStep(dtw_cost_t from, dtw_cost_t cost) {
+    return from == DTW_INFINITY ? DTW_INFINITY : from + cost;
+}
+
+// Similarity in [0, 1] comparable to compareSequences(). stored is a
+// template from encodeSequence(). Lengths may differ by up to
+// DTW_BAND_RADIUS samples.
+inline float dtwSimilarity(sample_t* recorded, int recordedLength, const template_t* stored, int length, sample_t recordedPeak, sample_t storedPeak, DtwScratch& scratch) {
+    if (recordedLength <= 0 || length <= 0 || recordedPeak == 0 || storedPeak == 0) {
+        return 0;
+    }
+    if (abs(recordedLength - length) > DTW_BAND_RADIUS) {
+        return 0;  // End point lies outside the band
+    }
+
+    const int width = 2 * DTW_BAND_RADIUS + 1;
+    norm_scale_t scale = liveScale(recordedPeak);
+    dtw_cost_t* previous = scratch.rows[0];
+    dtw_cost_t* current = scratch.rows[1];
+
+    for (int i = 0; i < recordedLength; i++) {
+        sample_t live[3];
+        for (int a = 0; a < 3; a++) {
+            live[a] = normalizeLive(recorded[i * 3 + a], scale);
+        }
+
+        // Slot k of row i holds column j = i - DTW_BAND_RADIUS + k, so in the
+        // previous row the same column sits one slot to the right
+        for (int k = 0; k < width; k++) {
+            int j = i - DTW_BAND_RADIUS + k;
+            if (j < 0 || j >= length) {
+                current[k] = DTW_INFINITY;
+                continue;
+            }
+
+            dtw_cost_t cost = dtwCellCost(live, stored + j * 3);
+            if (i == 0 && j == 0) {
+                current[k] = 2 * cost;
+                continue;
+            }
+
+            dtw_cost_t best = DTW_INFINITY;
+            if (i > 0 && k + 1 < width) {
+                best = min(best, dtwStep(previous[k + 1], cost));  // (i-1, j)
+            }
+            if (i > 0 && j > 0) {
+                best = min(best, dtwStep(previous[k], 2 * cost));  // (i-1, j-1)
+            }
+            if (k > 0) {
+                best = min(best, dtwStep(current[k - 1], cost));  // (i, j-1)
+            }
+            current[k] = best;
+        }
+
+        dtw_cost_t* swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    dtw_cost_t total = previous[(length - 1) - (recordedLength - 1) + DTW_BAND_RADIUS];
+    if (total == DTW_INFINITY) {
+        return 0;
+    }
+
+#if USE_FIXED_POINT
+    float meanDiff = (float)total / ((uint32_t)(recordedLength + length) * 3 * (NORM_ONE >> DTW_COST_SHIFT));
+#else
+    float meanDiff = total / ((recordedLength + length) * 3);
+#endif
+    float similarity = 1.0 - meanDiff / DTW_DIFF_SCALE;
+    return similarity > 0 ? similarity : 0;
+}
+
+// =============== NCC MATCHER =========================
+// Normalized cross-correlation per axis at every shift of up to NCC_MAX_LAG
+// samples. Each axis is centered on its own mean and scaled by its own
+// largest deviation, so a spike on one axis only lowers that axis' score
+// instead of squashing the whole sequence like the global peak does. The
+// scaled axes are int8, so the lag sums are 8x8-bit products in int32 and
+// the only divisions are two per axis, for its mean and its normalization.
+// Axes count in proportion to how far the template moves along them, so an
+// axis that only carried noise while enrolling hardly matters.
+
+// Largest shift tried either way, in samples. As with the DTW band, a share
+// of the resampled length when resampling, since the capture rate doesn't
+// change how long a resampled sequence is.
+#ifndef NCC_MAX_LAG
+#if USE_RESAMPLING
+#define NCC_MAX_LAG (RESAMPLE_LENGTH / 10)
+#else
+#define NCC_MAX_LAG SAMPLES_FOR_MS(60)
+#endif
+#endif
+#define NCC_UNIT 127  // Largest deviation of an axis once scaled to int8
+
+// Working memory of one NCC comparison
+struct NccScratch {
+    int8_t live[SEQUENCE_LENGTH];
+    int8_t stored[SEQUENCE_LENGTH];
+    float lagScores[2 * NCC_MAX_LAG + 1];  // Weighted correlation summed over axes, per lag
+};
+
+// Centers axis a of sequence on its mean and scales it into out so the
+// largest deviation is at most NCC_UNIT. Returns the summed absolute
+// deviation before scaling, which a single spike hardly moves, 0 for a flat
+// axis, and the sum of squares of out through energy.
+template <typename Value>
+sample_sum_t nccPrepareAxis(const Value* sequence, int length, int a, int8_t* out, int32_t& energy) {
+    sample_sum_t sum = 0;
+    for (int i = 0; i < length; i++) {
+        sum += decodeSample(sequence[i * 3 + a]);
+    }
+    sample_t mean = sum / length;
+
+    sample_sum_t deviation = 0;
+    sample_sum_t spread = 0;
+    for (int i = 0; i < length; i++) {
+        sample_sum_t offset = absSum((sample_sum_t)decodeSample(sequence[i * 3 + a]) - mean);
+        deviation = max(deviation, offset);
+        spread += offset;
+    }
+
+    energy = 0;
+    if (deviation == 0) {
+        return 0;
+    }
+#if USE_FIXED_POINT
+    // Correlation ignores scale, so a shift that brings the largest
+    // deviation into 64..127 does as well as an exact multiply
+    int shift = 0;
+    while ((deviation >> shift) > NCC_UNIT) {
+        shift++;
+    }
+#else
+    float reciprocal = NCC_UNIT / deviation;
+#endif
+    for (int i = 0; i < length; i++) {
+#if USE_FIXED_POINT
+        int8_t value = ((sample_sum_t)decodeSample(sequence[i * 3 + a]) - mean) >> shift;
+#else
+        int8_t value = (decodeSample(sequence[i * 3 + a]) - mean) * reciprocal;
+#endif
+        out[i] = value;
+        energy += value * value;
+    }
+    return spread;
+}
+
+// Similarity in [0, 1] comparable to compareSequences(): the weighted mean of
+// the per-axis correlations at the best lag, with anti-correlation scoring 0.
+// Both lengths must be at most SEQUENCE_LENGTH.
+inline float nccSimilarity(sample_t* recorded, int recordedLength, const template_t* stored, int length, sample_t recordedPeak, sample_t storedPeak, NccScratch& scratch) {
+    if (recordedLength <= 0 || length <= 0 || recordedPeak == 0 || storedPeak == 0) {
+        return 0;
+    }
+
+    for (int k = 0; k < 2 * NCC_MAX_LAG + 1; k++) {
+        scratch.lagScores[k] = 0;
+    }
+    float totalWeight = 0;
+    for (int a = 0; a < 3; a++) {
+        int32_t liveEnergy;
+        int32_t storedEnergy;
+        nccPrepareAxis(recorded, recordedLength, a, scratch.live, liveEnergy);
+        // All template axes share NORM_ONE units and length, so their spreads compare
+        float weight = nccPrepareAxis(stored, length, a, scratch.stored, storedEnergy);
+        totalWeight += weight;
+        if (liveEnergy == 0 || storedEnergy == 0) {
+            continue;  // Nothing to correlate, the axis scores 0
+        }
+
+        float scale = weight / sqrt((float)liveEnergy * storedEnergy);
+        for (int lag = -NCC_MAX_LAG; lag <= NCC_MAX_LAG; lag++) {
+            // Live sample i lines up with template sample i + lag
+            int first = max(0, -lag);
+            int last = min(recordedLength, length - lag);
+            int32_t sum = 0;
+            for (int i = first; i < last; i++) {
+                sum += scratch.live[i] * scratch.stored[i + lag];
+            }
+            scratch.lagScores[lag + NCC_MAX_LAG] += sum * scale;
+        }
+    }
+    if (totalWeight == 0) {
+        return 0;
+    }
+
+    float best = 0;
+    for (int k = 0; k < 2 * NCC_MAX_LAG + 1; k++) {
+        best = max(best, scratch.lagScores[k]);
+    }
+    return best / totalWeight;
+}
+
+// Working memory for either matcher. Only one comparison runs at a time, so
+// the two share it; the sketch lays it over the unused end of its capture
+// buffer, see CaptureArena there.
+union MatchScratch {
+    DtwScratch dtw;
+    NccScratch ncc;
+};
+
+// Linearly interpolates length samples onto destLength evenly spaced ones,
+// keeping the first and last. Works in place: shrinking walks forwards and
+// growing walks backwards, so no source sample is read after being replaced.
+inline void resampleSequence(const sample_t* source, int length, sample_t* dest, int destLength) {
+    // Source position of each output sample, Q16
+    uint32_t step = ((uint32_t)(length - 1) << 16) / (destLength - 1);
+    bool shrinking = length >= destLength;
+    for (int n = 0; n < destLength; n++) {
+        int i = shrinking ? n : destLength - 1 - n;
+        uint32_t position = i * step;
+        int index = position >> 16;
+        if (index >= length - 1) {
+            for (int a = 0; a < 3; a++) {
+                dest[i * 3 + a] = source[(length - 1) * 3 + a];
+            }
+            continue;
+        }
+        for (int a = 0; a < 3; a++) {
+            sample_t from = source[index * 3 + a];
+            sample_t to = source[(index + 1) * 3 + a];
+#if USE_FIXED_POINT
+            int32_t weight = (position >> 8) & 0xFF;
+            dest[i * 3 + a] = from + ((((int32_t)to - from) * weight) >> 8);
+#else
+            dest[i * 3 + a] = from + (to - from) * ((position & 0xFFFF) / 65536.0);
+#endif
+        }
+    }
+}
+
+#endif  // GESTURE_MATCH_H
@@ -1,8 +1,44 @@
 #include <Arduino.h>
 #include <Adafruit_CircuitPlayground.h>
+#include <SPI.h>
+#include <Wire.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
+
+// Template persistence backend: real EEPROM on AVR, FlashStorage's EEPROM
+// emulation on SAMD if the library is installed, otherwise none
+#if defined(__AVR__)
+#include <EEPROM.h>
+#define HAVE_PERSISTENT_STORAGE 1
+#define PERSIST_STORAGE_SIZE (E2END + 1)
+#elif defined(ARDUINO_ARCH_SAMD) && defined(__has_include)
+#if __has_include(<FlashAsEEPROM.h>)
+#include <FlashAsEEPROM.h>
+#define HAVE_PERSISTENT_STORAGE 1
+#define PERSIST_STORAGE_SIZE EEPROM_EMULATION_SIZE
+#endif
+#endif
+#ifndef HAVE_PERSISTENT_STORAGE
+#define HAVE_PERSISTENT_STORAGE 0
+#endif
+
+// Capture export transport: BLE UART on the Bluefruit if the Bluefruit
+// library is installed, otherwise Serial
+#if defined(ARDUINO_NRF52_ADAFRUIT) && defined(__has_include)
+#if __has_include(<bluefruit.h>)
+#include <bluefruit.h>
+#define HAVE_BLE_UART 1
+#endif
+#endif
+#ifndef HAVE_BLE_UART
+#define HAVE_BLE_UART 0
+#endif
 
 // =============== INSTRUCTIONS =========================
 // With USB port pointing towards user, press right button to record locking gesture
+// (any way up when built with USE_ORIENTATION_INVARIANT)
+// Repeat the gesture up to 3 times while recording, or hold still to finish early
 // After recording is done, red LED will turn on signifying that the system is locked
 // While system is locked, you are unable to record a new gesture
 // Use the left button to start the unlocking gesture
@@ -11,283 +47,3060 @@
 // After 3 incorrect attempts, system stays locked for period of time
 // Force unlock the board by flipping the slide switch in both directions
 // Slide switch must be on negative (-) side for proper functionality
+// Send 's' over Serial to dump the runtime counters, 'r' to reset them
+// Send 'c' over Serial while unlocked to calibrate the accelerometer
+
+
+// Capture geometry. Everything timed in samples below is derived from these,
+// so another rate only needs these two, e.g. -DSAMPLE_RATE_HZ=100
+// -DSEQUENCE_LENGTH=200 on the Express (too much RAM and EEPROM for the
+// Classic; build that variant with USE_PERSISTENCE 0 if the storage is small).
+#ifndef SAMPLE_RATE_HZ
+#define SAMPLE_RATE_HZ 50
+#endif
+#ifndef SEQUENCE_LENGTH
+#define SEQUENCE_LENGTH 50  // Samples kept per gesture, 1 s at 50 Hz
+#endif
+#if SEQUENCE_LENGTH > 255
+#error "SEQUENCE_LENGTH must fit the one-byte length fields of telemetry and persistence"
+#endif
+#define SAMPLES_FOR_MS(ms) ((int)((long)(ms) * SAMPLE_RATE_HZ / 1000))
 
+// Matching engine used for unlock attempts
+#define MATCH_ENGINE_TOLERANCE 0  // Index-by-index tolerance count, scored while capturing
+#define MATCH_ENGINE_DTW 1  // Dynamic time warping, tolerates faster or slower gestures
+#define MATCH_ENGINE_NCC 2  // Per-axis cross-correlation, tolerates shifts and one-axis spikes
+#ifndef MATCH_ENGINE
+#define MATCH_ENGINE MATCH_ENGINE_TOLERANCE
+#endif
 
-#define SEQUENCE_LENGTH 50
+// Set to 1 to resample templates and attempts linearly to RESAMPLE_LENGTH,
+// so comparisons cost the same for any capture rate or gesture duration.
+// Otherwise templates keep their captured length. The tolerance engine's
+// streaming score and early reject need the captured length, since a
+// sample's place in the resampled sequence isn't known until the capture
+// ends, so resampling is only on by default for DTW and NCC.
+#ifndef USE_RESAMPLING
+#define USE_RESAMPLING (MATCH_ENGINE != MATCH_ENGINE_TOLERANCE)
+#endif
+#ifndef RESAMPLE_LENGTH
+#define RESAMPLE_LENGTH 32  // Canonical samples per gesture, 2..SEQUENCE_LENGTH
+#endif
+#if USE_RESAMPLING
+#define TEMPLATE_LENGTH RESAMPLE_LENGTH
+#if RESAMPLE_LENGTH < 2 || RESAMPLE_LENGTH > SEQUENCE_LENGTH
+#error "RESAMPLE_LENGTH must be between 2 and SEQUENCE_LENGTH"
+#endif
+#else
+#define TEMPLATE_LENGTH SEQUENCE_LENGTH
+#endif
+
+// Matching core and its tuning (thresholds, tolerances, sample formats),
+// shared with the host replay tool in tools/
+#include "gesture_match.h"
+
+#define MAX_TEMPLATES 3  // Repetitions enrolled per recording, TEMPLATE_LENGTH * 6 bytes of RAM each
 #define MAX_ATTEMPTS 3
 #define LOCKOUT_DURATION 300000  // 5 minutes in milliseconds
+#define DEBOUNCE_MS 20  // Input must hold steady this long before it counts
+#define LOCKOUT_PULSE_MS 50  // Time per step of lockoutPulse, 64 steps = 3.2 s breath
+
+// Set to 0 to keep loop() spinning flat out. Otherwise the CPU idles between
+// passes whenever no capture or telemetry is in flight.
+#ifndef USE_IDLE_SLEEP
+#define USE_IDLE_SLEEP 1
+#endif
+#define SAMPLE_INTERVAL_US (1000000UL / SAMPLE_RATE_HZ)  // Fixed sample grid
+#define CAPTURE_WINDOW_MS 5000  // Maximum length of one gesture capture
+
+// Set to 1 to let templates follow slow drift in how the gesture is done.
+// An unlock scoring at least ADAPT_CONFIDENCE is blended into the template
+// it matched best, 1/2^ADAPT_RATE_SHIFT of the way, in place. The bar sits
+// above MATCH_THRESHOLD so borderline attempts never pull a template, and
+// only one template moves per unlock, so the others stay as enrolled.
+#ifndef USE_ADAPTIVE_TEMPLATES
+#define USE_ADAPTIVE_TEMPLATES 0
+#endif
+#ifndef ADAPT_CONFIDENCE
+#define ADAPT_CONFIDENCE 0.95  // Similarity an unlock needs to update a template
+#endif
+#define ADAPT_RATE_SHIFT 3  // Each update moves the template 1/8 of the way
+#if USE_ADAPTIVE_TEMPLATES && !USE_RESAMPLING
+#error "USE_ADAPTIVE_TEMPLATES needs USE_RESAMPLING so attempts line up with the templates"
+#endif
+
+// Motion-triggered capture. Activity is the summed per-axis change between
+// consecutive samples in m/s^2, so gravity and board orientation don't count.
+// Storing starts on the first active sample and stops after a quiet stretch,
+// which is trimmed off again. The thresholds are set as rates of change in
+// m/s^3 so they hold at any sample rate.
+#ifndef USE_GESTURE_SEGMENTER
+#define USE_GESTURE_SEGMENTER 1
+#endif
+#define SEGMENT_START_ACTIVITY (100.0 / SAMPLE_RATE_HZ)  // Activity that marks the start of a gesture
+#define SEGMENT_QUIET_ACTIVITY (30.0 / SAMPLE_RATE_HZ)  // Activity below this counts as holding still
+#define SEGMENT_QUIET_SAMPLES SAMPLES_FOR_MS(300)  // Quiet samples in a row that end the gesture
+#define SEGMENT_MIN_SAMPLES SAMPLES_FOR_MS(100)  // Shorter recordings are rejected as accidental
+
+// Streaming filter applied to each sample before segmenting and storing it.
+// A slow one-pole low-pass tracks gravity, which is subtracted out, and a fast
+// one smooths sensor noise, so templates no longer depend on board orientation.
+#ifndef USE_SAMPLE_FILTER
+#define USE_SAMPLE_FILTER 1
+#endif
+// Gravity tracker ~0.25 Hz, noise smoother ~5 Hz at every supported rate
+#if SAMPLE_RATE_HZ >= 200
+#define FILTER_GRAVITY_SHIFT 7
+#define FILTER_NOISE_SHIFT 3
+#elif SAMPLE_RATE_HZ >= 100
+#define FILTER_GRAVITY_SHIFT 6
+#define FILTER_NOISE_SHIFT 2
+#else
+#define FILTER_GRAVITY_SHIFT 5  // Alpha 1/32
+#define FILTER_NOISE_SHIFT 1  // Alpha 1/2
+#endif
+
+// Set to 0 to leave out the per-device accelerometer calibration, see
+// CALIBRATION below. Until one has been run samples pass through unchanged.
+#ifndef USE_CALIBRATION
+#define USE_CALIBRATION 1
+#endif
+#define CALIBRATION_MS 20000  // Time to turn the board through every orientation
+#define CALIBRATION_STILL_ACTIVITY (30.0 / SAMPLE_RATE_HZ)  // Activity below this counts as still
+#define CALIBRATION_STILL_SAMPLES SAMPLES_FOR_MS(200)  // Still samples in a row before readings count
+#define CALIBRATION_MIN_RANGE 16.0  // Span of an axis' extremes accepted, m/s^2 (2 g is 19.6)
+#define CALIBRATION_MAX_RANGE 24.0
+#define STANDARD_GRAVITY 9.80665
+
+// Set to 1 to store gestures in a frame that doesn't depend on how the board
+// is held, see ORIENTATION below. Templates are kept apart from ones recorded
+// the other way, so switching means enrolling again.
+#ifndef USE_ORIENTATION_INVARIANT
+#define USE_ORIENTATION_INVARIANT 0
+#endif
+#if USE_ORIENTATION_INVARIANT && !USE_SAMPLE_FILTER
+#error "USE_ORIENTATION_INVARIANT needs USE_SAMPLE_FILTER for its gravity estimate"
+#endif
+
+// Per-sample logging over Serial
+#define SAMPLE_LOG_NONE 0
+#define SAMPLE_LOG_TEXT 1  // Human readable, too slow to keep up with sampling - debug only
+#define SAMPLE_LOG_BINARY 2  // COBS-framed binary telemetry, see TELEMETRY below
+#ifndef SAMPLE_LOG
+#define SAMPLE_LOG SAMPLE_LOG_BINARY
+#endif
+#define SERIAL_BAUD 115200
+#define TELEMETRY_BUFFER_SIZE 128  // Transmit queue bytes, must be a power of two <= 128
+#define TELEMETRY_DECIMATION 1  // Send every Nth stored sample
+
+// Set to 0 to leave the runtime counters out of the build. Otherwise unlock
+// outcomes, scores, capture times, sample losses and loop latency are
+// counted in RAM and dumped over Serial on request, see STATS below.
+#ifndef USE_STATS
+#define USE_STATS 1
+#endif
+#define STATS_SCORE_BINS 10  // Similarity histogram, 10% per bin
+#define STATS_LOOP_BINS 12  // Loop latency histogram, doubling from 16 us
+#define STATS_LINE_MAX 32  // Serial space a dump line needs before it is written
+
+// Set to 1 to keep every capture in RAM and ship the batch in bulk while the
+// board is idle and unlocked, see EXPORT below
+#ifndef USE_CAPTURE_EXPORT
+#define USE_CAPTURE_EXPORT 0
+#endif
+#ifndef EXPORT_BUFFER_SIZE
+#if defined(__AVR__)
+#define EXPORT_BUFFER_SIZE (6 + 3 * SEQUENCE_LENGTH)  // One capture, all the Classic can spare
+#else
+#define EXPORT_BUFFER_SIZE 4096  // Bytes of queued captures, 6 + 3 per sample each
+#endif
+#endif
+#if USE_CAPTURE_EXPORT && defined(__AVR__) && EXPORT_BUFFER_SIZE > 512
+#error "EXPORT_BUFFER_SIZE doesn't fit the Classic's 2.5 KB of SRAM next to everything else"
+#endif
+#define EXPORT_CHUNK_SAMPLES 16  // Samples per export frame
+#define EXPORT_MODE_RECORD 1  // Capture modes, numbered as in the telemetry frames
+#define EXPORT_MODE_CHECK 2
+
+// Set to 0 to keep the template and lock state in RAM only
+#ifndef USE_PERSISTENCE
+#define USE_PERSISTENCE HAVE_PERSISTENT_STORAGE
+#endif
 
-float storedSequence[SEQUENCE_LENGTH][3];  // [ax,ay,az]
-int storedLength = 0;
-bool isRecording = false;
-bool isChecking = false;
-bool systemLocked = false;
-bool inLockout = false;
+#define SAMPLE_BUFFER_SIZE 16  // Ring buffer slots, must be a power of two <= 128
+
+// Set to 0 to leave the boot-time benchmark out of the build, see BENCHMARK below
+#ifndef USE_BENCHMARK
+#define USE_BENCHMARK 1
+#endif
+#define BENCH_RUNS 50  // Timed repetitions per stage
+
+// Set to 1 to capture through the LIS3DH hardware FIFO instead of polling
+// motionX/Y/Z. The accelerometer samples at ACCEL_FIFO_DATARATE on its own and
+// raises INT1 once ACCEL_FIFO_WATERMARK samples are queued; loop() then reads
+// all of them in one burst.
+#ifndef USE_ACCEL_FIFO
+#define USE_ACCEL_FIFO 0
+#endif
+// Must match SAMPLE_RATE_HZ, since the accelerometer keeps the time base
+#if SAMPLE_RATE_HZ == 50
+#define ACCEL_FIFO_DATARATE LIS3DH_DATARATE_50_HZ
+#elif SAMPLE_RATE_HZ == 100
+#define ACCEL_FIFO_DATARATE LIS3DH_DATARATE_100_HZ
+#elif SAMPLE_RATE_HZ == 200
+#define ACCEL_FIFO_DATARATE LIS3DH_DATARATE_200_HZ
+#elif USE_ACCEL_FIFO
+#error "USE_ACCEL_FIFO needs a SAMPLE_RATE_HZ the LIS3DH supports: 50, 100 or 200"
+#endif
+#define ACCEL_FIFO_WATERMARK 8  // Samples per wakeup, 1..31, keep below SAMPLE_BUFFER_SIZE
+
+// Set to 1 to also start an unlock attempt by tapping the board. While locked
+// the LIS3DH click detector drives INT1, so the tap itself wakes the CPU and
+// the capture begins on the next pass instead of after a button press.
+#ifndef USE_TAP_WAKE
+#define USE_TAP_WAKE 0
+#endif
+#define TAP_CLICKS 2  // 1 = single tap, 2 = double tap
+#define TAP_THRESHOLD_2G 80  // Click threshold at the 2 g range, halved per range step
+
+// LIS3DH registers used by the FIFO capture mode
+#define ACCEL_REG_CTRL3 0x22
+#define ACCEL_REG_CTRL5 0x24
+#define ACCEL_REG_OUT_X_L 0x28
+#define ACCEL_REG_FIFO_CTRL 0x2E
+#define ACCEL_REG_FIFO_SRC 0x2F
+#define ACCEL_CTRL3_I1_WTM 0x04  // Watermark interrupt on INT1
+#define ACCEL_CTRL5_FIFO_EN 0x40
+#define ACCEL_CTRL5_LIR_INT1 0x08  // What the library's setClick() leaves in CTRL5
+#define ACCEL_FIFO_MODE_BYPASS 0x00
+#define ACCEL_FIFO_MODE_STREAM 0x80
+#define ACCEL_FIFO_SRC_OVRN 0x40
+#define ACCEL_FIFO_SRC_FSS 0x1F
+
+// Keeps the compiler from moving buffer accesses across index updates. Enough on
+// single-core parts where the only concurrency is an ISR on the same core.
+#define MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// One [ax,ay,az] reading in flight between the sampler and loop()
+struct AccelSample {
+    sample_t axis[3];
+};
+
+// Enrolled repetitions of the gesture, [ax,ay,az], normalized and encoded
+// by storeTemplate() once recorded
+template_t storedSequences[MAX_TEMPLATES][TEMPLATE_LENGTH][3];
+
+// The one large working buffer, reused in phases:
+//   capture  every recording and attempt fills capture from the start
+//   match    matchTemplates() has resampled the attempt in place to
+//            TEMPLATE_LENGTH, and the matcher works in scratch right behind it
+// Both phases are sized here at link time, so matching adds nothing to the
+// stack and the DTW and NCC buffers take the end of the capture that
+// resampling freed. The tolerance engine needs no scratch, except to benchmark
+// the others.
+#define ARENA_SCRATCH (MATCH_ENGINE != MATCH_ENGINE_TOLERANCE || USE_BENCHMARK)
+union CaptureArena {
+    sample_t capture[SEQUENCE_LENGTH][3];
+#if ARENA_SCRATCH
+    struct {
+        sample_t live[TEMPLATE_LENGTH][3];
+        MatchScratch scratch;
+    } match;
+#endif
+};
+CaptureArena captureArena;
+sample_t (&currentSequence)[SEQUENCE_LENGTH][3] = captureArena.capture;  // Capture in progress
+#if ARENA_SCRATCH
+MatchScratch& matchScratch = captureArena.match.scratch;
+#endif
+int storedLengths[MAX_TEMPLATES];
+sample_t storedPeaks[MAX_TEMPLATES];  // Largest |axis| of each template before normalization
+GestureFeatures storedFeatures[MAX_TEMPLATES];
+int templateCount = 0;
+int matchedTemplate = -1;  // Template the last attempt scored best against, -1 if none
+
+// Top-level state. Everything from STATE_LOCKED on has a locked template.
+enum SystemState {
+    STATE_IDLE,       // Unlocked, waiting for a gesture to record
+    STATE_RECORDING,  // Capturing a new template
+    STATE_CALIBRATING,  // Collecting still readings for the accelerometer calibration
+    STATE_LOCKED,     // Waiting for an unlock attempt
+    STATE_CHECKING,   // Capturing an unlock attempt
+    STATE_LOCKOUT     // Too many failed attempts, attempts refused
+};
+SystemState systemState = STATE_IDLE;
+
+// Edge events produced by the debounced inputs
+enum InputEvent {
+    EVENT_NONE,
+    EVENT_LEFT_PRESS,
+    EVENT_RIGHT_PRESS,
+    EVENT_OVERRIDE,  // Slide switch moved to the override (+) side
+    EVENT_TAP  // Accelerometer click while tap wake is armed
+};
+
+struct DebouncedInput {
+    bool stable;    // Debounced level
+    bool raw;       // Last level read
+    unsigned long changedAt;  // millis() when raw last changed
+};
+
+// Event counters kept by STATS, dumped in this order under statNames
+enum StatCounter {
+    STAT_RECORDINGS,      // Repetitions enrolled
+    STAT_ATTEMPTS,        // Unlock attempts scored
+    STAT_UNLOCKS,
+    STAT_REJECTS,
+    STAT_EMPTY_ATTEMPTS,  // Attempts without a gesture, not held against the user
+    STAT_EARLY_REJECTS,   // Captures cut short by the streaming match
+    STAT_LOCKOUTS,
+    STAT_ABORTS,
+    STAT_ADAPTATIONS,     // Templates blended towards an unlock
+    STAT_DROPPED_SAMPLES, // Ring buffer overruns
+    STAT_MISSED_SAMPLES,  // Sample slots the sampler fell behind on
+    STAT_EXPORT_DROPPED,  // Captures that found the export buffer full
+    STAT_COUNT
+};
+
+DebouncedInput leftInput = {false, false, 0};
+DebouncedInput rightInput = {false, false, 0};
+DebouncedInput switchInput = {false, false, 0};
 
 // Attempt tracking
 int failedAttempts = 0;
 unsigned long lockoutStartTime = 0;
+int lockoutPulseLevel = -1;  // Brightness last written to pixel 0, -1 if unknown
+
+// Capture scheduling - samples are taken on a fixed micros() grid
+bool samplerRunning = false;
+int samplesTaken = 0;
+int sampleCount = 0;
+int captureTarget = 0;  // Samples the consumer stores at most
+int sampleBudget = 0;  // Samples the sampler takes at most
+unsigned long captureStartTime = 0;
+unsigned long nextSampleTime = 0;
+unsigned int missedSamples = 0;
+sample_t capturePeak = 0;  // Largest |axis| seen so far, tracked as samples arrive
+
+// Gesture segmenter state. sampleCount covers the committed gesture; the
+// quietRun samples stored after it are only kept if motion resumes.
+bool gestureStarted = false;
+bool gestureEnded = false;
+bool gestureOverflow = false;  // Still moving when the buffer filled up
+int quietRun = 0;
+int armQuietRun = 0;  // Quiet samples still needed before motion counts as a start
+AccelSample lastSample;
+bool haveLastSample = false;
+
+// Filter state per axis. In fixed point it carries FILTER_STATE_BITS extra
+// fraction bits so the shifts don't truncate small changes away.
+sample_sum_t filterGravity[3];
+sample_sum_t filterSmooth[3];
+bool filterPrimed = false;
+
+// Running score of the unlock attempt, updated as each sample arrives
+int streamMatches[MAX_TEMPLATES];
+int streamHardMisses[MAX_TEMPLATES];  // Misses that no later peak increase can turn into matches
+sample_t streamPeak = 0;  // capturePeak the counts above were computed with
+norm_scale_t streamScale = 0;
+
+// Single-producer/single-consumer sample queue. Only the producer writes
+// sampleHead and only the consumer writes sampleTail; both are single bytes so
+// reads and writes are atomic on AVR as well as ARM and no interrupt masking is
+// needed. Indices run freely and are masked on access.
+AccelSample sampleBuffer[SAMPLE_BUFFER_SIZE];
+volatile uint8_t sampleHead = 0;
+volatile uint8_t sampleTail = 0;
+volatile uint8_t droppedSamples = 0;
+
+#if USE_TAP_WAKE
+volatile bool tapPending = false;  // Set by the INT1 ISR while the click detector is routed to it
+bool tapArmed = false;
+#endif
+
+#if USE_ACCEL_FIFO
+volatile bool accelFifoReady = false;  // Set by the INT1 watermark ISR
+#if USE_FIXED_POINT
+int32_t accelCountScale = 0;  // Raw left-justified count to Q7.8 m/s^2, scaled by 2^12
+#else
+float accelCountScale = 0;  // Raw left-justified count to m/s^2 for the active range
+#endif
+#endif
+
+// One step of a pixel animation: paint pixels [first, first + count) and
+// hold for durationMs before the next step
+struct PixelKeyframe {
+    uint16_t durationMs;
+    uint8_t first;
+    uint8_t count;
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+};
+
+#define FRAME_COUNT(frames) (sizeof(frames) / sizeof(frames[0]))
+
+// Quick red flash on pixel 0 - already locked / locked out
+const PixelKeyframe alertFlash[] PROGMEM = {
+    {100, 0, 1, 255, 0, 0}, {100, 0, 1, 0, 0, 0},
+    {100, 0, 1, 255, 0, 0}, {100, 0, 1, 0, 0, 0},
+    {100, 0, 1, 255, 0, 0}, {100, 0, 1, 0, 0, 0},
+};
+
+// Recording complete - green blink
+const PixelKeyframe recordedBlink[] PROGMEM = {
+    {200, 0, 1, 0, 255, 0}, {200, 0, 1, 0, 0, 0},
+    {200, 0, 1, 0, 255, 0}, {200, 0, 1, 0, 0, 0},
+};
+
+// Unlocked - green spiral, held before clearing
+const PixelKeyframe successSpiral[] PROGMEM = {
+    {50, 0, 1, 0, 255, 0}, {50, 1, 1, 0, 255, 0}, {50, 2, 1, 0, 255, 0},
+    {50, 3, 1, 0, 255, 0}, {50, 4, 1, 0, 255, 0}, {50, 5, 1, 0, 255, 0},
+    {50, 6, 1, 0, 255, 0}, {50, 7, 1, 0, 255, 0}, {50, 8, 1, 0, 255, 0},
+    {550, 9, 1, 0, 255, 0}, {0, 0, 10, 0, 0, 0},
+};
+
+// Wrong gesture - all pixels flash red
+const PixelKeyframe failureFlash[] PROGMEM = {
+    {100, 0, 10, 255, 0, 0}, {100, 0, 10, 0, 0, 0},
+    {100, 0, 10, 255, 0, 0}, {100, 0, 10, 0, 0, 0},
+    {100, 0, 10, 255, 0, 0}, {100, 0, 10, 0, 0, 0},
+};
+
+// Lockout entered - all pixels red, then the lockout pulse takes over
+const PixelKeyframe lockoutAlert[] PROGMEM = {
+    {1000, 0, 10, 255, 0, 0}, {0, 0, 10, 0, 0, 0},
+};
+
+// Lockout breathing curve, one period of a raised cosine with 2.2 gamma
+// applied so it fades evenly to the eye
+const uint8_t lockoutPulse[64] PROGMEM = {
+    0, 0, 0, 0, 0, 1, 1, 2, 4, 6, 9, 14, 19, 26, 34, 44,
+    55, 68, 82, 97, 113, 130, 147, 164, 180, 196, 210, 223, 234, 243, 250, 254,
+    255, 254, 250, 243, 234, 223, 210, 196, 180, 164, 147, 130, 113, 97, 82, 68,
+    55, 44, 34, 26, 19, 14, 9, 6, 4, 2, 1, 1, 0, 0, 0, 0,
+};
+
+// Animation player state, ticked from loop()
+const PixelKeyframe* animationFrames = NULL;  // NULL when idle
+uint8_t animationLength = 0;
+uint8_t animationIndex = 0;
+uint16_t animationFrameDuration = 0;
+unsigned long animationFrameStart = 0;
 
 void checkSequence();
 void recordSequence();
-float compareSequences(float* recorded, float* stored, int length);
+bool pushSample(const AccelSample& sample);
+bool popSample(AccelSample& sample);
+void pollSampler();
+void stopSampler();
+void setupAccelFifo();
+void setupTapWake();
+void updateTapWake();
+void disarmTapWake();
+void serviceCapture();
+sample_sum_t motionActivity(const AccelSample& sample, const AccelSample& previous);
+bool commitSample();
+void abortCapture();
+void finishRecording();
+void finishChecking();
+void storeTemplate(int t, int length);
+void adaptTemplate(int t);
+int longestTemplate();
+void resetStreamingMatch();
+void updateStreamingMatch();
+bool streamingMatchHopeless();
+float matchTemplates();
 void enterLockout();
 void checkLockoutStatus();
 void clearAllPixels();  // New helper function
+bool systemLocked();
+bool capturing();
+InputEvent pollInputs();
+void handleEvent(InputEvent event);
+void playAnimation(const PixelKeyframe* frames, uint8_t length);
+bool animationPlaying(const PixelKeyframe* frames);
+void stopAnimation();
+void serviceAnimation();
+void loadPersistedState();
+void persistTemplate();
+void cancelPersistJob();
+void servicePersistence();
+void loadCalibration();
+void saveCalibration();
+void startCalibration();
+void serviceCalibration();
+void serviceCommands();
+void startStatsDump();
+void resetStats();
+void telemetryCaptureBegin();
+void telemetrySample(int index, const sample_t* sample);
+void telemetryCaptureEnd(float similarity);
+void drainTelemetry();
+void setupExport();
+int exportCapture(uint8_t mode);
+void exportScore(int record, float similarity);
+void serviceExport();
+void statsCount(StatCounter counter);
+void statsCapture(unsigned long durationMs);
+void statsScore(float similarity);
+void statsLoop(unsigned long latencyUs);
+void serviceStats();
+bool telemetryPending();
+void idleSleep();
+void runBenchmark();
 
 void setup() {
     CircuitPlayground.begin();
-    Serial.begin(9600);
+    Serial.begin(SERIAL_BAUD);
+#if USE_ACCEL_FIFO
+    setupAccelFifo();
+#endif
+#if USE_TAP_WAKE
+    setupTapWake();
+#endif
+#if USE_CAPTURE_EXPORT
+    setupExport();
+#endif
     CircuitPlayground.redLED(false);
-    systemLocked = false;
+    systemState = STATE_IDLE;
+    // Start from the current levels so nothing already held fires an event
+    switchInput.stable = switchInput.raw = CircuitPlayground.slideSwitch();
+    leftInput.stable = leftInput.raw = CircuitPlayground.leftButton();
+    rightInput.stable = rightInput.raw = CircuitPlayground.rightButton();
     clearAllPixels();
+#if USE_PERSISTENCE
+    loadPersistedState();
+#endif
+#if USE_BENCHMARK
+    // Holding both buttons through boot runs the benchmark before normal use
+    if (leftInput.stable && rightInput.stable) {
+        runBenchmark();
+    }
+#endif
 }
 
-// New helper function to ensure all pixels are cleared
+// New helper function to ensure all pixels are cleared. Also cancels any
+// animation still playing, since whoever clears is taking over the pixels.
 void clearAllPixels() {
+    stopAnimation();
     for(int i = 0; i < 10; i++) {
         CircuitPlayground.setPixelColor(i, 0, 0, 0);
     }
 }
 
+void applyKeyframe() {
+    PixelKeyframe frame;
+    memcpy_P(&frame, animationFrames + animationIndex, sizeof(frame));
+    for (uint8_t i = frame.first; i < frame.first + frame.count; i++) {
+        CircuitPlayground.setPixelColor(i, frame.red, frame.green, frame.blue);
+    }
+    animationFrameDuration = frame.durationMs;
+    animationFrameStart = millis();
+}
+
+// Starts a keyframe animation from PROGMEM, replacing any that is playing.
+// The first frame is shown immediately, the rest from serviceAnimation().
+void playAnimation(const PixelKeyframe* frames, uint8_t length) {
+    animationFrames = frames;
+    animationLength = length;
+    animationIndex = 0;
+    applyKeyframe();
+}
+
+// frames == NULL asks whether anything is playing
+bool animationPlaying(const PixelKeyframe* frames) {
+    return frames == NULL ? animationFrames != NULL : animationFrames == frames;
+}
+
+void stopAnimation() {
+    animationFrames = NULL;
+}
+
+void serviceAnimation() {
+    if (animationFrames == NULL || millis() - animationFrameStart < animationFrameDuration) {
+        return;
+    }
+    animationIndex++;
+    if (animationIndex >= animationLength) {
+        animationFrames = NULL;
+        return;
+    }
+    applyKeyframe();
+}
+
 void loop() {
+#if USE_STATS
+    unsigned long loopStart = micros();
+#endif
+    // Take a sample if one is due, then process whatever is queued - never blocks
+    pollSampler();
+    serviceCapture();
+
+#if USE_CALIBRATION
+    // Samples the calibration run on its own grid - never blocks
+    serviceCalibration();
+#endif
+
+    // Advance LED feedback - never blocks
+    serviceAnimation();
+
     // Check if we're in lockout and handle timeout
     checkLockoutStatus();
 
-    // Left button for recording gesture and locking
-    if (CircuitPlayground.leftButton()) {
-        if (!isRecording && !isChecking && !inLockout && !systemLocked) {  // Added !systemLocked check
-            recordSequence();
-            systemLocked = true;
-            failedAttempts = 0;
-            CircuitPlayground.redLED(true);
-            Serial.println("System Locked with new gesture");
-        } else if (systemLocked) {
-            // Provide feedback that system is already locked
-            Serial.println("System already locked - cannot record new gesture");
-            // Visual feedback - quick red flash
-            for(int i = 0; i < 3; i++) {
-                CircuitPlayground.setPixelColor(0, 255, 0, 0);
-                delay(100);
-                CircuitPlayground.setPixelColor(0, 0, 0, 0);
-                delay(100);
-            }
-        }
+#if USE_PERSISTENCE
+    // Writes at most one byte per pass so EEPROM latency never stalls the loop
+    servicePersistence();
+#endif
+
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    // Hands queued telemetry to Serial only as fast as it can take it
+    drainTelemetry();
+#endif
+
+#if USE_CAPTURE_EXPORT
+    // Ships at most one frame of queued captures per pass, only while idle
+    serviceExport();
+#endif
+
+#if USE_TAP_WAKE
+    // Routes the click detector to INT1 exactly while a tap may start an attempt
+    updateTapWake();
+#endif
+
+    // Buttons and switch act once per debounced press, not while held
+    InputEvent event = pollInputs();
+    if (event != EVENT_NONE) {
+        handleEvent(event);
+    }
+
+    // At most one command byte from Serial per pass
+    serviceCommands();
+
+#if USE_STATS
+    // Writes at most one dump line per pass
+    serviceStats();
+    statsLoop(micros() - loopStart);  // Work only, the nap below doesn't count
+#endif
+
+#if USE_IDLE_SLEEP
+    // Captures need every pass to hit the sample grid, and telemetry drains
+    // fastest without a nap between chunks
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    if (!capturing() && !telemetryPending()) {
+#else
+    if (!capturing()) {
+#endif
+        idleSleep();
     }
+#endif
+}
 
-    // Right button for checking gesture and unlocking
-    if (CircuitPlayground.rightButton()) {
-        if (systemLocked && !isRecording && !isChecking && storedLength > 0) {
-            if (!inLockout) {
-                checkSequence();
-            } else {
-                // Show lockout status
-                Serial.print("System is locked out for ");
-                Serial.print((LOCKOUT_DURATION - (millis() - lockoutStartTime)) / 1000);
-                Serial.println(" more seconds");
+#if USE_IDLE_SLEEP
+// Sleeps the CPU until the next interrupt. Every target keeps a 1 ms system
+// tick running (Timer0 on AVR, SysTick on SAMD), which wakes us, so millis()
+// timing and input polling carry on and a press still lands within a tick.
+void idleSleep() {
+#if defined(__AVR__)
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+#elif defined(ARDUINO_ARCH_SAMD)
+    __WFI();
+#else
+    delay(1);  // Blocks the loop task so the FreeRTOS idle task can sleep
+#endif
+}
+#endif
+
+bool systemLocked() {
+    return systemState >= STATE_LOCKED;
+}
                 
-                // Visual feedback for lockout
-                for(int i = 0; i < 3; i++) {
-                    CircuitPlayground.setPixelColor(0, 255, 0, 0);
-                    delay(100);
-                    CircuitPlayground.setPixelColor(0, 0, 0, 0);
-                    delay(100);
-                }
-            }
-        }
+bool capturing() {
+    return systemState == STATE_RECORDING || systemState == STATE_CHECKING;
+}
+
+// Returns true on a debounced rising edge
+bool debounceInput(DebouncedInput& input, bool level) {
+    unsigned long now = millis();
+    if (level != input.raw) {
+        input.raw = level;
+        input.changedAt = now;
+        return false;
+    }
+    if (level == input.stable || now - input.changedAt < DEBOUNCE_MS) {
+        return false;
+    }
+    input.stable = level;
+    return level;
+}
+
+// Reads every input once and returns at most one event, override first.
+// Reads are cheap digital pin reads (the buttons and switch are not all on
+// interrupt-capable pins on the Classic), so latency is DEBOUNCE_MS plus one
+// pass of the non-blocking loop.
+InputEvent pollInputs() {
+    bool overridden = debounceInput(switchInput, CircuitPlayground.slideSwitch());
+    bool left = debounceInput(leftInput, CircuitPlayground.leftButton());
+    bool right = debounceInput(rightInput, CircuitPlayground.rightButton());
+    if (overridden) {
+        return EVENT_OVERRIDE;
+    }
+    if (switchInput.stable) {
+        return EVENT_NONE;  // Buttons are ignored while the switch is on override
     }
+    if (left) {
+        return EVENT_LEFT_PRESS;
+    }
+    if (right) {
+        return EVENT_RIGHT_PRESS;
+    }
+#if USE_TAP_WAKE
+    if (tapArmed && tapPending) {
+        tapPending = false;
+        return EVENT_TAP;
+    }
+#endif
+    return EVENT_NONE;
+}
 
-    // Override with slide switch
-    if (CircuitPlayground.slideSwitch()) {
+void handleEvent(InputEvent event) {
+    // Override with slide switch - also cancels a capture mid-gesture
+    if (event == EVENT_OVERRIDE) {
+        if (capturing()) {
+            abortCapture();
+        }
         CircuitPlayground.redLED(false);
-        systemLocked = false;
-        inLockout = false;
+        systemState = STATE_IDLE;
         failedAttempts = 0;
         clearAllPixels();
+        Serial.println(F("Override - system unlocked"));
+        return;
+    }
+
+    switch (systemState) {
+    case STATE_IDLE:
+        // Left button for recording gesture and locking
+        if (event == EVENT_LEFT_PRESS) {
+            recordSequence();
+        }
+        break;
+    case STATE_LOCKED:
+        if (event == EVENT_LEFT_PRESS) {
+            // Provide feedback that system is already locked
+            Serial.println(F("System already locked - cannot record new gesture"));
+            playAnimation(alertFlash, FRAME_COUNT(alertFlash));
+        } else if (templateCount > 0) {
+            // Right button (or a tap) for checking gesture and unlocking
+            checkSequence();
+        }
+        break;
+    case STATE_LOCKOUT:
+        if (event == EVENT_LEFT_PRESS) {
+            Serial.println(F("System already locked - cannot record new gesture"));
+        } else {
+            // Show lockout status
+            Serial.print(F("System is locked out for "));
+            Serial.print((LOCKOUT_DURATION - (millis() - lockoutStartTime)) / 1000);
+            Serial.println(F(" more seconds"));
+        }
+        // Visual feedback for lockout
+        playAnimation(alertFlash, FRAME_COUNT(alertFlash));
+        break;
+    default:
+        break;  // Presses during a capture are ignored
+    }
+}
+
+// Single-byte commands from Serial, see INSTRUCTIONS
+void serviceCommands() {
+    switch (Serial.read()) {
+#if USE_STATS
+    case 's':
+        startStatsDump();
+        break;
+    case 'r':
+        resetStats();
+        break;
+#endif
+#if USE_CALIBRATION
+    case 'c':
+        startCalibration();
+        break;
+#endif
+    default:
+        break;  // Nothing waiting, or not a command
     }
 }
 
 void checkLockoutStatus() {
-    if (inLockout) {
+    if (systemState == STATE_LOCKOUT) {
         // Check if lockout period is over
         if (millis() - lockoutStartTime >= LOCKOUT_DURATION) {
-            inLockout = false;
+            systemState = STATE_LOCKED;
             failedAttempts = 0;
-            Serial.println("Lockout period ended. System ready for new attempts.");
+            Serial.println(F("Lockout period ended. System ready for new attempts."));
             clearAllPixels();
+        } else if (animationPlaying(NULL)) {
+            lockoutPulseLevel = -1;  // Feedback owns the pixels, repaint after it
         } else {
-            // Pulse red LED during lockout
-            int pulseValue = (sin(millis() / 500.0) + 1) * 127;
-            CircuitPlayground.setPixelColor(0, pulseValue, 0, 0);
+            // Pulse red LED during lockout, only touching the pixel on a change
+            uint8_t step = (millis() / LOCKOUT_PULSE_MS) % sizeof(lockoutPulse);
+            uint8_t level = pgm_read_byte(&lockoutPulse[step]);
+            if (level != lockoutPulseLevel) {
+                lockoutPulseLevel = level;
+                CircuitPlayground.setPixelColor(0, level, 0, 0);
+            }
         }
     }
 }
 
 void enterLockout() {
-    inLockout = true;
+    systemState = STATE_LOCKOUT;
     lockoutStartTime = millis();
-    Serial.println("Too many failed attempts. System locked for 5 minutes.");
+    Serial.println(F("Too many failed attempts. System locked for 5 minutes."));
+#if USE_STATS
+    statsCount(STAT_LOCKOUTS);
+#endif
     
     // Visual indication of lockout
-    for(int i = 0; i < 10; i++) {
-        CircuitPlayground.setPixelColor(i, 255, 0, 0);
+    playAnimation(lockoutAlert, FRAME_COUNT(lockoutAlert));
+}
+
+// Producer side. Safe to call from an ISR. Returns false and counts a drop
+// when the consumer has fallen a full buffer behind.
+bool pushSample(const AccelSample& sample) {
+    uint8_t head = sampleHead;
+    if ((uint8_t)(head - sampleTail) >= SAMPLE_BUFFER_SIZE) {
+        droppedSamples++;
+        return false;
     }
+    sampleBuffer[head & (SAMPLE_BUFFER_SIZE - 1)] = sample;
+    MEMORY_BARRIER();  // Publish the slot before the index
+    sampleHead = head + 1;
+    return true;
 }
 
-void recordSequence() {
-    Serial.println("Recording started - 5 second gesture");
-    isRecording = true;
-    int sampleCount = 0;
-    unsigned long startTime = millis();
-    
-    clearAllPixels();
-    // Start recording indicator
-    CircuitPlayground.setPixelColor(0, 255, 165, 0);
-    
-    while ((millis() - startTime) < 5000 && sampleCount < SEQUENCE_LENGTH) {
-        storedSequence[sampleCount][0] = CircuitPlayground.motionX();
-        storedSequence[sampleCount][1] = CircuitPlayground.motionY();
-        storedSequence[sampleCount][2] = CircuitPlayground.motionZ();
-        
-        // Visual feedback - light up pixels based on motion
-        int intensity = abs(storedSequence[sampleCount][0]) * 255;
-        CircuitPlayground.setPixelColor(sampleCount % 10, intensity, 0, intensity);
-        
-        Serial.print("Sample "); 
-        Serial.print(sampleCount);
-        Serial.print(": X=");
-        Serial.print(storedSequence[sampleCount][0], 2);
-        Serial.print(" Y=");
-        Serial.print(storedSequence[sampleCount][1], 2);
-        Serial.print(" Z=");
-        Serial.println(storedSequence[sampleCount][2], 2);
-        
-        sampleCount++;
-        delay(20);
+// Consumer side, called from loop() only
+bool popSample(AccelSample& sample) {
+    uint8_t tail = sampleTail;
+    if (tail == sampleHead) {
+        return false;
     }
-    
-    storedLength = sampleCount;
-    isRecording = false;
-    
-    clearAllPixels();
-    
-    // Completion animation - Green blink
-    for(int i = 0; i < 2; i++) {
-        CircuitPlayground.setPixelColor(0, 0, 255, 0);
-        delay(200);
-        CircuitPlayground.setPixelColor(0, 0, 0, 0);
-        delay(200);
+    sample = sampleBuffer[tail & (SAMPLE_BUFFER_SIZE - 1)];
+    MEMORY_BARRIER();  // Finish reading the slot before handing it back
+    sampleTail = tail + 1;
+    return true;
+}
+
+#if USE_ACCEL_FIFO
+// =============== LIS3DH FIFO =========================
+// Direct register access so a whole FIFO's worth of XYZ triples can be read in
+// a single bus transaction. With FIFO enabled the LIS3DH rolls the read address
+// back from OUT_Z_H to OUT_X_L, so consecutive triples stream out back to back.
+
+#if defined(__AVR__)
+// Circuit Playground Classic - LIS3DH on hardware SPI
+#define ACCEL_BURST_MAX 32  // Whole FIFO in one transaction
+const SPISettings accelSpiSettings(500000, MSBFIRST, SPI_MODE0);
+
+void accelWriteRegister(uint8_t reg, uint8_t value) {
+    SPI.beginTransaction(accelSpiSettings);
+    digitalWrite(CPLAY_LIS3DH_CS, LOW);
+    SPI.transfer(reg & 0x3F);
+    SPI.transfer(value);
+    digitalWrite(CPLAY_LIS3DH_CS, HIGH);
+    SPI.endTransaction();
+}
+
+void accelBeginRead(uint8_t reg, uint8_t count) {
+    SPI.beginTransaction(accelSpiSettings);
+    digitalWrite(CPLAY_LIS3DH_CS, LOW);
+    SPI.transfer(reg | 0xC0);  // Read with address auto-increment
+}
+
+uint8_t accelReadNext() {
+    return SPI.transfer(0xFF);
+}
+
+void accelEndRead() {
+    digitalWrite(CPLAY_LIS3DH_CS, HIGH);
+    SPI.endTransaction();
+}
+#else
+// Express / Bluefruit - LIS3DH on the internal I2C bus
+#define ACCEL_BURST_MAX 10  // Keep each read inside the smallest Wire RX buffer (64 bytes)
+#define ACCEL_WIRE Wire1
+
+void accelWriteRegister(uint8_t reg, uint8_t value) {
+    ACCEL_WIRE.beginTransmission(CPLAY_LIS3DH_ADDRESS);
+    ACCEL_WIRE.write(reg);
+    ACCEL_WIRE.write(value);
+    ACCEL_WIRE.endTransmission();
+}
+
+void accelBeginRead(uint8_t reg, uint8_t count) {
+    ACCEL_WIRE.beginTransmission(CPLAY_LIS3DH_ADDRESS);
+    ACCEL_WIRE.write(reg | 0x80);  // Address auto-increment
+    ACCEL_WIRE.endTransmission(false);
+    ACCEL_WIRE.requestFrom((uint8_t)CPLAY_LIS3DH_ADDRESS, count);
+}
+
+uint8_t accelReadNext() {
+    return ACCEL_WIRE.read();
+}
+
+void accelEndRead() {
+}
+#endif
+
+uint8_t accelReadRegister(uint8_t reg) {
+    accelBeginRead(reg, 1);
+    uint8_t value = accelReadNext();
+    accelEndRead();
+    return value;
+}
+
+sample_t countsToSample(int16_t counts) {
+#if USE_FIXED_POINT
+    int32_t value = ((int32_t)counts * accelCountScale) >> 12;
+    return constrain(value, -SAMPLE_MAX, SAMPLE_MAX);
+#else
+    return counts * accelCountScale;
+#endif
+}
+
+void accelFifoISR() {
+    accelFifoReady = true;
+#if USE_TAP_WAKE
+    tapPending = true;  // Same pin; only one source is routed to it at a time
+#endif
+}
+
+// Configures rate, watermark interrupt and FIFO. Range is left as set by
+// CircuitPlayground.begin() so values match the motionX/Y/Z path.
+void setupAccelFifo() {
+    CircuitPlayground.lis.setDataRate(ACCEL_FIFO_DATARATE);
+
+    // Same scale factors the library uses for its m/s^2 events
+    float countsPerG;
+    switch (CircuitPlayground.lis.getRange()) {
+        case LIS3DH_RANGE_16_G: countsPerG = 1365; break;
+        case LIS3DH_RANGE_8_G:  countsPerG = 4096; break;
+        case LIS3DH_RANGE_4_G:  countsPerG = 8190; break;
+        default:                countsPerG = 16380; break;
     }
-    
-    Serial.print("Recording complete. Collected ");
-    Serial.print(sampleCount);
-    Serial.println(" samples");
+#if USE_FIXED_POINT
+    accelCountScale = (int32_t)(9.80665 * (1 << SAMPLE_FRAC_BITS) * 4096 / countsPerG + 0.5);
+#else
+    accelCountScale = 9.80665 / countsPerG;
+#endif
+
+    accelWriteRegister(ACCEL_REG_CTRL3, ACCEL_CTRL3_I1_WTM);
+    accelWriteRegister(ACCEL_REG_CTRL5, ACCEL_CTRL5_FIFO_EN);
+    accelWriteRegister(ACCEL_REG_FIFO_CTRL, ACCEL_FIFO_MODE_BYPASS);
+
+    pinMode(CPLAY_LIS3DH_INTERRUPT, INPUT);
+    attachInterrupt(digitalPinToInterrupt(CPLAY_LIS3DH_INTERRUPT), accelFifoISR, RISING);
 }
 
-void checkSequence() {
-    Serial.println("Checking gesture - perform the same motion");
-    Serial.print("Attempt ");
-    Serial.print(failedAttempts + 1);
-    Serial.print(" of ");
-    Serial.println(MAX_ATTEMPTS);
-    
-    isChecking = true;
-    float currentSequence[SEQUENCE_LENGTH][3];
-    int sampleCount = 0;
-    unsigned long startTime = millis();
-    
-    clearAllPixels();
-    // Start checking indicator - Purple
-    CircuitPlayground.setPixelColor(0, 255, 0, 255);
-    
-    while ((millis() - startTime) < 5000 && sampleCount < storedLength) {
-        currentSequence[sampleCount][0] = CircuitPlayground.motionX();
-        currentSequence[sampleCount][1] = CircuitPlayground.motionY();
-        currentSequence[sampleCount][2] = CircuitPlayground.motionZ();
-        
-        // Visual feedback
-        int intensity = abs(currentSequence[sampleCount][0]) * 255;
-        CircuitPlayground.setPixelColor(sampleCount % 10, intensity, 0, intensity);
-        
-        Serial.print("Check Sample "); 
-        Serial.print(sampleCount);
-        Serial.print(": X=");
-        Serial.print(currentSequence[sampleCount][0], 2);
-        Serial.print(" Y=");
-        Serial.print(currentSequence[sampleCount][1], 2);
-        Serial.print(" Z=");
-        Serial.println(currentSequence[sampleCount][2], 2);
-        
-        sampleCount++;
-        delay(20);
+// Bypass mode empties the FIFO; stream mode then keeps the newest 32 samples
+void startAccelFifo() {
+    accelWriteRegister(ACCEL_REG_FIFO_CTRL, ACCEL_FIFO_MODE_BYPASS);
+    accelFifoReady = false;
+    accelWriteRegister(ACCEL_REG_FIFO_CTRL, ACCEL_FIFO_MODE_STREAM | ACCEL_FIFO_WATERMARK);
+}
+
+void stopAccelFifo() {
+    accelWriteRegister(ACCEL_REG_FIFO_CTRL, ACCEL_FIFO_MODE_BYPASS);
+}
+
+// Moves queued FIFO samples into the ring buffer. Only takes as many as the
+// ring can hold; the rest wait in the FIFO for the next call.
+void drainAccelFifo() {
+    uint8_t status = accelReadRegister(ACCEL_REG_FIFO_SRC);
+    uint8_t available = status & ACCEL_FIFO_SRC_FSS;
+    if (status & ACCEL_FIFO_SRC_OVRN) {
+        available = 32;
+        missedSamples++;  // Oldest samples were overwritten
     }
-    
-    float similarity = compareSequences((float*)currentSequence, (float*)storedSequence, storedLength);
-    Serial.print("Gesture match: ");
-    Serial.print(similarity * 100);
-    Serial.println("%");
-    
-    clearAllPixels();
-    
-    if (similarity > 0.85) {  // 85% match threshold
-        Serial.println("Gesture Matched! System Unlocked");
-        systemLocked = false;
-        failedAttempts = 0;
-        CircuitPlayground.redLED(false);
-        // Success animation - green spiral
-        for(int i = 0; i < 10; i++) {
-            CircuitPlayground.setPixelColor(i, 0, 255, 0);
-            delay(50);
-        }
-        delay(500);
-        clearAllPixels();
-    } else {
-        failedAttempts++;
-        Serial.print("Gesture Did Not Match - ");
-        Serial.print(MAX_ATTEMPTS - failedAttempts);
-        Serial.println(" attempts remaining");
-        
-        if (failedAttempts >= MAX_ATTEMPTS) {
-            enterLockout();
-        } else {
-            // Failure animation - red flash
-            for(int i = 0; i < 3; i++) {
-                for(int j = 0; j < 10; j++) {
-                    CircuitPlayground.setPixelColor(j, 255, 0, 0);
-                }
-                delay(100);
-                clearAllPixels();
-                delay(100);
+
+    uint8_t space = SAMPLE_BUFFER_SIZE - (uint8_t)(sampleHead - sampleTail);
+    int remaining = sampleBudget - samplesTaken;
+    uint8_t count = min(available, space);
+    if (count > remaining) {
+        count = remaining;
+    }
+
+    while (count > 0) {
+        uint8_t burst = min(count, (uint8_t)ACCEL_BURST_MAX);
+        accelBeginRead(ACCEL_REG_OUT_X_L, burst * 6);
+        for (uint8_t n = 0; n < burst; n++) {
+            AccelSample sample;
+            for (uint8_t a = 0; a < 3; a++) {
+                uint8_t lo = accelReadNext();
+                uint8_t hi = accelReadNext();
+                sample.axis[a] = countsToSample((int16_t)((hi << 8) | lo));
             }
+            pushSample(sample);
+            samplesTaken++;
         }
+        accelEndRead();
+        count -= burst;
     }
-    
+}
+#endif
+
+#if USE_TAP_WAKE
+// =============== TAP WAKE =========================
+// The click detector is only routed to INT1 while locked and idle, so taps
+// that are part of a gesture can't start another attempt, and in FIFO mode
+// INT1 carries the watermark during captures as before. The interrupt fires
+// once the tap (or the second of a double tap) is over, and the segmenter
+// waits for motion after that, so the tap itself is not captured.
+
+#if !USE_ACCEL_FIFO
+void accelTapISR() {
+    tapPending = true;
+}
+#endif
+
+// Attaches the INT1 handler; the FIFO code already has one on the same pin
+void setupTapWake() {
+#if !USE_ACCEL_FIFO
+    pinMode(CPLAY_LIS3DH_INTERRUPT, INPUT);
+    attachInterrupt(digitalPinToInterrupt(CPLAY_LIS3DH_INTERRUPT), accelTapISR, RISING);
+#endif
+}
+
+void armTapWake() {
+    // Counts per g halve with each range step, so the threshold follows
+    uint8_t threshold;
+    switch (CircuitPlayground.lis.getRange()) {
+        case LIS3DH_RANGE_16_G: threshold = TAP_THRESHOLD_2G / 8; break;
+        case LIS3DH_RANGE_8_G:  threshold = TAP_THRESHOLD_2G / 4; break;
+        case LIS3DH_RANGE_4_G:  threshold = TAP_THRESHOLD_2G / 2; break;
+        default:                threshold = TAP_THRESHOLD_2G; break;
+    }
+    // Routes clicks to INT1, replacing CTRL3 and CTRL5
+    CircuitPlayground.lis.setClick(TAP_CLICKS, threshold);
+#if USE_ACCEL_FIFO
+    accelWriteRegister(ACCEL_REG_CTRL5, ACCEL_CTRL5_FIFO_EN | ACCEL_CTRL5_LIR_INT1);
+#endif
+    CircuitPlayground.lis.getClick();  // Clears a click latched before arming
+    tapPending = false;
+    tapArmed = true;
+}
+
+void disarmTapWake() {
+    if (!tapArmed) {
+        return;
+    }
+    CircuitPlayground.lis.setClick(0, 0);
+#if USE_ACCEL_FIFO
+    accelWriteRegister(ACCEL_REG_CTRL3, ACCEL_CTRL3_I1_WTM);
+    accelWriteRegister(ACCEL_REG_CTRL5, ACCEL_CTRL5_FIFO_EN);
+#endif
+    tapPending = false;
+    tapArmed = false;
+}
+
+void updateTapWake() {
+    bool wanted = systemState == STATE_LOCKED && templateCount > 0;
+    if (wanted && !tapArmed) {
+        armTapWake();
+    } else if (!wanted) {
+        disarmTapWake();
+    }
+}
+#endif
+
+// Converts a library reading in m/s^2 to the storage format
+sample_t toSample(float value) {
+#if USE_FIXED_POINT
+    float scaled = value * (1 << SAMPLE_FRAC_BITS);
+    if (scaled >= SAMPLE_MAX) {
+        return SAMPLE_MAX;
+    }
+    if (scaled <= -SAMPLE_MAX) {
+        return -SAMPLE_MAX;
+    }
+    return (sample_t)lround(scaled);
+#else
+    return value;
+#endif
+}
+
+// Converts a stored sample back to m/s^2 for logging and LED feedback
+float sampleToFloat(sample_t value) {
+#if USE_FIXED_POINT
+    return value / (float)(1 << SAMPLE_FRAC_BITS);
+#else
+    return value;
+#endif
+}
+
+// Reads one [ax,ay,az] sample
+void takeSample(AccelSample& sample) {
+    sample.axis[0] = toSample(CircuitPlayground.motionX());
+    sample.axis[1] = toSample(CircuitPlayground.motionY());
+    sample.axis[2] = toSample(CircuitPlayground.motionZ());
+}
+
+#if USE_FIXED_POINT
+#define FILTER_STATE_BITS 8
+#define FILTER_STEP(delta, shift) ((delta) >> (shift))
+#else
+#define FILTER_STEP(delta, shift) ((delta) / (1 << (shift)))
+#endif
+
+// Removes gravity and noise from a sample in place. The first sample of a
+// capture seeds the gravity estimate, so there is no settling transient.
+void filterSample(AccelSample& sample) {
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        sample_sum_t input = (sample_sum_t)sample.axis[a] << FILTER_STATE_BITS;
+#else
+        sample_sum_t input = sample.axis[a];
+#endif
+        if (!filterPrimed) {
+            filterGravity[a] = input;
+            filterSmooth[a] = 0;
+        }
+        filterGravity[a] += FILTER_STEP(input - filterGravity[a], FILTER_GRAVITY_SHIFT);
+        filterSmooth[a] += FILTER_STEP(input - filterGravity[a] - filterSmooth[a], FILTER_NOISE_SHIFT);
+#if USE_FIXED_POINT
+        sample_sum_t output = (filterSmooth[a] + (1 << (FILTER_STATE_BITS - 1))) >> FILTER_STATE_BITS;
+        sample.axis[a] = (sample_t)constrain(output, -SAMPLE_MAX, SAMPLE_MAX);
+#else
+        sample.axis[a] = filterSmooth[a];
+#endif
+    }
+    filterPrimed = true;
+}
+
+#if USE_CALIBRATION
+// =============== CALIBRATION =========================
+// Per-axis offset and scale for the accelerometer's zero-g bias and
+// sensitivity, applied to every sample before it is filtered. Sending 'c'
+// while unlocked starts a CALIBRATION_MS run: turn the board so each axis
+// points straight up and straight down at some point, pausing a moment in
+// each position. Readings taken while still are gravity alone, so offset and
+// scale are what put each axis' extremes at +/-1 g. The gravity filter hides
+// most of a bias anyway; the real gain is a true gravity direction for
+// USE_ORIENTATION_INVARIANT and axes that agree on scale.
+
+#if USE_FIXED_POINT
+typedef int16_t cal_scale_t;
+#define CAL_SCALE_SHIFT 14  // Q1.14, 1.0 = 16384
+#define CAL_SCALE_ONE (1 << CAL_SCALE_SHIFT)
+#else
+typedef float cal_scale_t;
+#define CAL_SCALE_ONE 1.0f
+#endif
+
+sample_t calOffset[3] = {0, 0, 0};
+cal_scale_t calScale[3] = {CAL_SCALE_ONE, CAL_SCALE_ONE, CAL_SCALE_ONE};
+
+// Run in progress
+unsigned long calStartTime = 0;
+unsigned long calNextSampleTime = 0;
+AccelSample calLastSample;
+int calStillRun = 0;
+sample_sum_t calSmooth[3];  // Reading averaged over the current still stretch
+bool calSeen = false;  // calMin/calMax hold at least one still reading
+sample_t calMin[3];
+sample_t calMax[3];
+
+void calibrateSample(AccelSample& sample) {
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        int32_t value = ((int32_t)(sample.axis[a] - calOffset[a]) * calScale[a]) >> CAL_SCALE_SHIFT;
+        sample.axis[a] = constrain(value, -SAMPLE_MAX, SAMPLE_MAX);
+#else
+        sample.axis[a] = (sample.axis[a] - calOffset[a]) * calScale[a];
+#endif
+    }
+}
+
+void printCalibration() {
+    for (int a = 0; a < 3; a++) {
+        Serial.print((char)('X' + a));
+        Serial.print(F(": offset "));
+        Serial.print(sampleToFloat(calOffset[a]), 2);
+        Serial.print(F(" m/s^2, scale "));
+        Serial.println((float)calScale[a] / CAL_SCALE_ONE, 3);
+    }
+}
+
+void startCalibration() {
+    if (systemState != STATE_IDLE) {
+        Serial.println(F("Unlock the board and let it finish what it is doing before calibrating"));
+        return;
+    }
+    Serial.println(F("Calibrating - point each axis straight up and straight down, pausing in each position"));
+    systemState = STATE_CALIBRATING;
+    calStartTime = millis();
+    calNextSampleTime = micros();
+    takeSample(calLastSample);
+    calStillRun = 0;
+    calSeen = false;
+
     clearAllPixels();
-    isChecking = false;
+    CircuitPlayground.setPixelColor(0, 0, 0, 255);
 }
 
-float compareSequences(float* recorded, float* stored, int length) {
-    float matchCount = 0;
-    float tolerance = 0.3;  // Tolerance for matching
-    
-    // Normalize the sequences first
-    float maxRecorded = 0;
-    float maxStored = 0;
-    
-    // Use normalization method
-    for(int i = 0; i < length * 3; i++) {
-        maxRecorded = max(maxRecorded, abs(recorded[i]));
-        maxStored = max(maxStored, abs(stored[i]));
+void finishCalibration() {
+    systemState = STATE_IDLE;
+    clearAllPixels();
+
+    sample_t offset[3];
+    cal_scale_t scale[3];
+    for (int a = 0; a < 3; a++) {
+        sample_sum_t range = calSeen ? (sample_sum_t)calMax[a] - calMin[a] : 0;
+        if (range < SAMPLE_UNITS(CALIBRATION_MIN_RANGE) || range > SAMPLE_UNITS(CALIBRATION_MAX_RANGE)) {
+            Serial.print(F("Calibration failed - axis "));
+            Serial.print((char)('X' + a));
+            Serial.println(F(" was not held still both pointing up and pointing down"));
+            playAnimation(failureFlash, FRAME_COUNT(failureFlash));
+            return;
+        }
+        offset[a] = ((sample_sum_t)calMax[a] + calMin[a]) / 2;
+#if USE_FIXED_POINT
+        scale[a] = (int32_t)(2 * STANDARD_GRAVITY * (1 << SAMPLE_FRAC_BITS) * CAL_SCALE_ONE) / range;
+#else
+        scale[a] = 2 * STANDARD_GRAVITY / range;
+#endif
     }
-    
-    for(int i = 0; i < length * 3; i++) {
-        float normalizedRecorded = recorded[i] / maxRecorded;
-        float normalizedStored = stored[i] / maxStored;
-        
-        if(fabs(normalizedRecorded - normalizedStored) < tolerance) {
-            matchCount++;
+
+    for (int a = 0; a < 3; a++) {
+        calOffset[a] = offset[a];
+        calScale[a] = scale[a];
+    }
+    Serial.println(F("Calibration complete"));
+    printCalibration();
+    playAnimation(recordedBlink, FRAME_COUNT(recordedBlink));
+#if USE_PERSISTENCE
+    saveCalibration();
+#endif
+}
+
+// Takes one reading per SAMPLE_INTERVAL_US while a run is in progress. Once
+// CALIBRATION_STILL_SAMPLES in a row have been still, the extremes follow
+// their running average, so sensor noise doesn't widen them.
+void serviceCalibration() {
+    if (systemState != STATE_CALIBRATING) {
+        return;
+    }
+    if (millis() - calStartTime >= CALIBRATION_MS) {
+        finishCalibration();
+        return;
+    }
+    unsigned long now = micros();
+    if ((long)(now - calNextSampleTime) < 0) {
+        return;
+    }
+    calNextSampleTime = now + SAMPLE_INTERVAL_US;
+
+    AccelSample sample;
+    takeSample(sample);
+    bool still = motionActivity(sample, calLastSample) < SAMPLE_UNITS(CALIBRATION_STILL_ACTIVITY);
+    calLastSample = sample;
+    calStillRun = still ? calStillRun + 1 : 0;
+    for (int a = 0; a < 3; a++) {
+        calSmooth[a] += calStillRun <= 1 ? sample.axis[a] - calSmooth[a] : (sample.axis[a] - calSmooth[a]) / 8;
+    }
+    if (calStillRun < CALIBRATION_STILL_SAMPLES) {
+        return;
+    }
+    for (int a = 0; a < 3; a++) {
+        sample_t level = calSmooth[a];
+        if (!calSeen || level < calMin[a]) {
+            calMin[a] = level;
+        }
+        if (!calSeen || level > calMax[a]) {
+            calMax[a] = level;
         }
     }
-    
-    return matchCount / (length * 3);
-}
\ No newline at end of file
+    calSeen = true;
+}
+#endif
+
+#if USE_ORIENTATION_INVARIANT
+// =============== ORIENTATION =========================
+// Holding the board another way changes which of its axes a gesture moves
+// along, which a board-frame comparison can't forgive. Instead each capture
+// fixes "up" from the filter's gravity estimate at its first stored sample,
+// and every sample is stored as
+//   0  movement along up, signed
+//   1  movement across it, as a magnitude
+//   2  total movement magnitude
+// none of which change with how the board is held. What is given up is the
+// heading of horizontal movement, so e.g. left and right swipes look alike.
+
+#if USE_FIXED_POINT
+#define ORIENT_UNIT_SHIFT 14
+int16_t orientUp[3];  // Unit vector, Q1.14
+#else
+float orientUp[3];
+#endif
+bool orientReady = false;  // Cleared by beginCapture()
+
+// A board in free fall has no gravity estimate, so then up is its own Z axis
+void captureOrientation() {
+    float gravity[3];
+    float length = 0;
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        gravity[a] = filterGravity[a] / (float)(1L << (SAMPLE_FRAC_BITS + FILTER_STATE_BITS));
+#else
+        gravity[a] = filterGravity[a];
+#endif
+        length += gravity[a] * gravity[a];
+    }
+    length = sqrt(length);
+    bool falling = length < STANDARD_GRAVITY / 4;
+    for (int a = 0; a < 3; a++) {
+        float up = falling ? (a == 2) : gravity[a] / length;
+#if USE_FIXED_POINT
+        orientUp[a] = lround(up * (1 << ORIENT_UNIT_SHIFT));
+#else
+        orientUp[a] = up;
+#endif
+    }
+    orientReady = true;
+}
+
+// Replaces a filtered board-frame [ax,ay,az] with [along, across, total]
+void orientSample(sample_t* value) {
+    if (!orientReady) {
+        captureOrientation();
+    }
+#if USE_FIXED_POINT
+    int32_t along = 0;
+    uint32_t total = 0;
+    for (int a = 0; a < 3; a++) {
+        along += (int32_t)value[a] * orientUp[a];
+        total += (int32_t)value[a] * value[a];
+    }
+    along >>= ORIENT_UNIT_SHIFT;
+    uint32_t alongSquared = (uint32_t)abs(along) * abs(along);
+    uint32_t across = total > alongSquared ? total - alongSquared : 0;
+    value[0] = constrain(along, -SAMPLE_MAX, SAMPLE_MAX);
+    value[1] = min(lround(sqrt((float)across)), (long)SAMPLE_MAX);
+    value[2] = min(lround(sqrt((float)total)), (long)SAMPLE_MAX);
+#else
+    float along = 0;
+    float total = 0;
+    for (int a = 0; a < 3; a++) {
+        along += value[a] * orientUp[a];
+        total += value[a] * value[a];
+    }
+    value[0] = along;
+    value[1] = sqrt(max(total - along * along, 0.0f));
+    value[2] = sqrt(total);
+#endif
+}
+#endif
+
+void beginCapture(int target) {
+#if USE_TAP_WAKE
+    disarmTapWake();  // INT1 belongs to the capture from here on
+#endif
+    // Discard anything left over from an aborted capture
+    sampleTail = sampleHead;
+    droppedSamples = 0;
+
+    samplesTaken = 0;
+    sampleCount = 0;
+    captureTarget = target;
+    // The segmenter discards idle samples, so it keeps sampling until the
+    // window closes or it sees the gesture end
+    sampleBudget = USE_GESTURE_SEGMENTER ? 0x7FFF : target;
+    gestureStarted = !USE_GESTURE_SEGMENTER;
+    gestureEnded = false;
+    gestureOverflow = false;
+    quietRun = 0;
+    armQuietRun = 0;
+    haveLastSample = false;
+    filterPrimed = false;
+#if USE_ORIENTATION_INVARIANT
+    orientReady = false;
+#endif
+    missedSamples = 0;
+    capturePeak = 0;
+    resetStreamingMatch();
+    captureStartTime = millis();
+    nextSampleTime = micros();  // First sample is due immediately
+    samplerRunning = true;
+#if USE_ACCEL_FIFO
+    startAccelFifo();
+#endif
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    telemetryCaptureBegin();
+#endif
+}
+
+// Acquisition side. Takes a sample whenever the next slot on the fixed
+// SAMPLE_INTERVAL_US grid is due, so processing time in loop() doesn't add
+// drift between samples. In FIFO mode the accelerometer keeps the time base
+// and this just drains it when the watermark is reached.
+void pollSampler() {
+    if (!samplerRunning) {
+        return;
+    }
+
+#if USE_ACCEL_FIFO
+    // Also check the pin level in case an edge arrived while we were busy
+    if (accelFifoReady || digitalRead(CPLAY_LIS3DH_INTERRUPT) == HIGH) {
+        accelFifoReady = false;
+        drainAccelFifo();
+    }
+#else
+    unsigned long now = micros();
+    if ((long)(now - nextSampleTime) < 0) {
+        return;  // Next sample not due yet
+    }
+
+    AccelSample sample;
+    takeSample(sample);
+    pushSample(sample);
+    samplesTaken++;
+
+    // Stay on the grid. If we fell a whole period behind, skip the missed
+    // slots instead of bursting samples back to back.
+    nextSampleTime += SAMPLE_INTERVAL_US;
+    if ((long)(now - nextSampleTime) >= 0) {
+        unsigned long behind = (now - nextSampleTime) / SAMPLE_INTERVAL_US + 1;
+        missedSamples += behind;
+        nextSampleTime += behind * SAMPLE_INTERVAL_US;
+    }
+#endif
+
+    if ((millis() - captureStartTime) >= CAPTURE_WINDOW_MS || samplesTaken >= sampleBudget) {
+#if USE_ACCEL_FIFO
+        drainAccelFifo();  // Pick up the partial batch below the watermark
+#endif
+        stopSampler();
+    }
+}
+
+void stopSampler() {
+#if USE_ACCEL_FIFO
+    stopAccelFifo();
+#endif
+    samplerRunning = false;
+}
+
+// Copies a sample into the capture at index, with LED and Serial feedback
+void storeSample(int index, const AccelSample& sample) {
+    sample_t* dest = (sample_t*)currentSequence + index * 3;
+    dest[0] = sample.axis[0];
+    dest[1] = sample.axis[1];
+    dest[2] = sample.axis[2];
+#if USE_ORIENTATION_INVARIANT
+    orientSample(dest);
+#endif
+
+    // Visual feedback - light up pixels based on motion
+    int intensity = abs(sampleToFloat(dest[0])) * 255;
+    CircuitPlayground.setPixelColor(index % 10, intensity, 0, intensity);
+
+#if SAMPLE_LOG == SAMPLE_LOG_TEXT
+    Serial.print(systemState == STATE_RECORDING ? F("Sample ") : F("Check Sample "));
+    Serial.print(index);
+    Serial.print(F(": X="));
+    Serial.print(sampleToFloat(dest[0]), 2);
+    Serial.print(F(" Y="));
+    Serial.print(sampleToFloat(dest[1]), 2);
+    Serial.print(F(" Z="));
+    Serial.println(sampleToFloat(dest[2]), 2);
+#elif SAMPLE_LOG == SAMPLE_LOG_BINARY
+    telemetrySample(index, dest);
+#endif
+}
+
+// Makes the stored sample at sampleCount part of the gesture. Returns true if
+// the unlock attempt can no longer reach MATCH_THRESHOLD.
+bool commitSample() {
+    sample_t* committed = (sample_t*)currentSequence + sampleCount * 3;
+    for (int a = 0; a < 3; a++) {
+        capturePeak = max(capturePeak, (sample_t)abs(committed[a]));
+    }
+    sampleCount++;
+
+    if (systemState == STATE_CHECKING && MATCH_ENGINE == MATCH_ENGINE_TOLERANCE && !USE_RESAMPLING) {
+        updateStreamingMatch();
+        return streamingMatchHopeless();
+    }
+    return false;
+}
+
+sample_sum_t motionActivity(const AccelSample& sample, const AccelSample& previous) {
+    sample_sum_t activity = 0;
+    for (int a = 0; a < 3; a++) {
+        sample_sum_t change = (sample_sum_t)sample.axis[a] - previous.axis[a];
+        activity += change < 0 ? -change : change;
+    }
+    return activity;
+}
+
+// Runs one sample through the segmenter. Returns true if the unlock attempt
+// can no longer reach MATCH_THRESHOLD.
+bool segmentSample(const AccelSample& sample) {
+    sample_sum_t activity = haveLastSample ? motionActivity(sample, lastSample) : 0;
+    AccelSample previous = lastSample;
+    bool hadPrevious = haveLastSample;
+    lastSample = sample;
+    haveLastSample = true;
+
+    if (!gestureStarted) {
+        if (armQuietRun > 0) {
+            // The last gesture was still going when its capture filled up, so
+            // its remainder mustn't start this one
+            armQuietRun = activity < SAMPLE_UNITS(SEGMENT_QUIET_ACTIVITY) ? armQuietRun - 1 : SEGMENT_QUIET_SAMPLES;
+            return false;
+        }
+        if (!hadPrevious || activity < SAMPLE_UNITS(SEGMENT_START_ACTIVITY)) {
+            return false;  // Still idle, drop it
+        }
+        // Motion began between the two samples, so keep the earlier one too
+        gestureStarted = true;
+        Serial.println(F("Motion detected"));
+        storeSample(sampleCount, previous);
+        if (commitSample()) {
+            return true;
+        }
+        if (sampleCount >= captureTarget) {
+            return false;
+        }
+    }
+
+    if (activity < SAMPLE_UNITS(SEGMENT_QUIET_ACTIVITY)) {
+        // Past the end of the buffer the stillness is only counted: it is
+        // trimmed off anyway unless motion resumes, and then it can't fit
+        if (sampleCount + quietRun < captureTarget) {
+            storeSample(sampleCount + quietRun, sample);
+        }
+        quietRun++;
+        if (quietRun >= SEGMENT_QUIET_SAMPLES) {
+            gestureEnded = true;
+        }
+        return false;
+    }
+    if (sampleCount + quietRun >= captureTarget) {
+        gestureOverflow = true;
+        return false;
+    }
+
+    // Motion resumed, so the quiet stretch was part of the gesture
+    storeSample(sampleCount + quietRun, sample);
+    while (quietRun > 0) {
+        quietRun--;
+        if (commitSample()) {
+            return true;
+        }
+    }
+    return commitSample();
+}
+
+// Processing side. Drains queued samples into the active sequence and
+// finishes the capture once the gesture is complete, or as soon as an unlock
+// attempt can no longer reach MATCH_THRESHOLD.
+void serviceCapture() {
+    if (!capturing()) {
+        return;
+    }
+
+    bool rejected = false;
+    AccelSample sample;
+    // The segmenter watches for the end even once the buffer is full, and
+    // flags gestureOverflow if the motion goes on instead
+    while (!gestureEnded && !gestureOverflow && (USE_GESTURE_SEGMENTER || sampleCount < captureTarget) && popSample(sample)) {
+#if USE_CALIBRATION
+        calibrateSample(sample);
+#endif
+#if USE_SAMPLE_FILTER
+        filterSample(sample);
+#endif
+#if USE_GESTURE_SEGMENTER
+        rejected = segmentSample(sample);
+#else
+        storeSample(sampleCount, sample);
+        rejected = commitSample();
+#endif
+        if (rejected) {
+            break;
+        }
+    }
+
+    bool full = USE_GESTURE_SEGMENTER ? gestureOverflow : sampleCount >= captureTarget;
+    if (!rejected && !gestureEnded && !full && (samplerRunning || sampleTail != sampleHead)) {
+        return;
+    }
+    stopSampler();
+    quietRun = 0;  // Trailing stillness is not part of the gesture
+
+    if (rejected) {
+#if USE_STATS
+        statsCount(STAT_EARLY_REJECTS);
+#endif
+        Serial.print(F("Rejected early after "));
+        Serial.print(sampleCount);
+        Serial.print(F(" of "));
+        Serial.print(captureTarget);
+        Serial.println(F(" samples"));
+    }
+
+    if (droppedSamples > 0) {
+        Serial.print(F("Dropped samples: "));
+        Serial.println(droppedSamples);
+    }
+#if USE_STATS
+    statsCapture(millis() - captureStartTime);
+#endif
+    if (systemState == STATE_RECORDING) {
+        finishRecording();
+    } else {
+        finishChecking();
+    }
+}
+
+// Cancels a capture in progress, e.g. when the override switch is flipped
+void abortCapture() {
+    Serial.println(F("Capture aborted"));
+#if USE_STATS
+    statsCount(STAT_ABORTS);
+#endif
+    stopSampler();
+    systemState = systemState == STATE_RECORDING ? STATE_IDLE : STATE_LOCKED;
+    sampleCount = 0;
+    clearAllPixels();
+}
+
+void recordSequence() {
+#if USE_PERSISTENCE
+    cancelPersistJob();  // The template it was copying is about to change
+#endif
+    Serial.print(F("Recording started - gesture of up to "));
+    Serial.print(SEQUENCE_LENGTH * 1000L / SAMPLE_RATE_HZ);
+    Serial.println(F(" ms"));
+    templateCount = 0;
+    systemState = STATE_RECORDING;
+    beginCapture(SEQUENCE_LENGTH);
+    
+    clearAllPixels();
+    // Start recording indicator
+    CircuitPlayground.setPixelColor(0, 255, 165, 0);
+}
+    
+void finishRecording() {
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    telemetryCaptureEnd(0);
+#endif
+#if USE_GESTURE_SEGMENTER
+    if (sampleCount > 0 && !gestureEnded) {
+        // Filled up, or the window closed, while still moving: the slice
+        // holds only the start of the gesture, so it isn't a repetition
+        Serial.print(F("Gesture longer than "));
+        Serial.print(SEQUENCE_LENGTH * 1000L / SAMPLE_RATE_HZ);
+        Serial.println(F(" ms - hold still, then repeat it faster"));
+        beginCapture(SEQUENCE_LENGTH);
+        armQuietRun = SEGMENT_QUIET_SAMPLES;
+        return;
+    }
+#endif
+    if (sampleCount >= SEGMENT_MIN_SAMPLES) {
+#if USE_CAPTURE_EXPORT
+        exportCapture(EXPORT_MODE_RECORD);  // Before resampling replaces it
+#endif
+        int t = templateCount++;
+#if USE_STATS
+        statsCount(STAT_RECORDINGS);
+#endif
+#if USE_RESAMPLING
+        resampleSequence((sample_t*)currentSequence, sampleCount, (sample_t*)currentSequence, RESAMPLE_LENGTH);
+        storeTemplate(t, RESAMPLE_LENGTH);
+#else
+        storeTemplate(t, sampleCount);
+#endif
+
+        Serial.print(F("Repetition "));
+        Serial.print(templateCount);
+        Serial.print(F(" recorded. Collected "));
+        Serial.print(sampleCount);
+        Serial.println(F(" samples"));
+        if (missedSamples > 0) {
+            Serial.print(F("Missed sample slots: "));
+            Serial.println(missedSamples);
+        }
+
+        if (templateCount < MAX_TEMPLATES) {
+            // Go straight on to the next repetition; a capture window without
+            // a gesture ends the enrollment with what was recorded
+            Serial.println(F("Repeat the gesture to enroll it again, or hold still to finish"));
+            beginCapture(SEQUENCE_LENGTH);
+            clearAllPixels();
+            CircuitPlayground.setPixelColor(0, 255, 165, 0);
+            return;
+        }
+    } else if (templateCount == 0) {
+        systemState = STATE_IDLE;
+        clearAllPixels();
+        Serial.println(F("No gesture detected - recording cancelled"));
+        return;
+    }
+    
+    clearAllPixels();
+    
+    // Completion animation - Green blink
+    playAnimation(recordedBlink, FRAME_COUNT(recordedBlink));
+    
+    Serial.print(F("Recording complete. Enrolled "));
+    Serial.print(templateCount);
+    Serial.println(F(" repetitions"));
+
+    systemState = STATE_LOCKED;
+    failedAttempts = 0;
+    CircuitPlayground.redLED(true);
+    Serial.println(F("System Locked with new gesture"));
+#if USE_PERSISTENCE
+    persistTemplate();
+#endif
+}
+
+void checkSequence() {
+    Serial.println(F("Checking gesture - perform the same motion"));
+    Serial.print(F("Attempt "));
+    Serial.print(failedAttempts + 1);
+    Serial.print(F(" of "));
+    Serial.println(MAX_ATTEMPTS);
+    
+    systemState = STATE_CHECKING;
+    beginCapture(USE_RESAMPLING ? SEQUENCE_LENGTH : longestTemplate());
+    
+    clearAllPixels();
+    // Start checking indicator - Purple
+    CircuitPlayground.setPixelColor(0, 255, 0, 255);
+}
+    
+void finishChecking() {
+    if (sampleCount == 0) {
+        // Nothing to judge, so don't count it against the user
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+        telemetryCaptureEnd(0);
+#endif
+#if USE_STATS
+        statsCount(STAT_EMPTY_ATTEMPTS);
+#endif
+        systemState = STATE_LOCKED;
+        clearAllPixels();
+        Serial.println(F("No gesture detected"));
+        return;
+    }
+
+#if USE_CAPTURE_EXPORT
+    int exportRecord = exportCapture(EXPORT_MODE_CHECK);  // Before matchTemplates() resamples it
+#endif
+    float similarity = matchTemplates();
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    telemetryCaptureEnd(similarity);
+#endif
+#if USE_CAPTURE_EXPORT
+    exportScore(exportRecord, similarity);
+#endif
+#if USE_STATS
+    statsScore(similarity);
+#endif
+    Serial.print(F("Gesture match: "));
+    Serial.print(similarity * 100);
+    Serial.println(F("%"));
+    
+    clearAllPixels();
+    
+    if (similarity > MATCH_THRESHOLD) {  // 85% match threshold
+        Serial.println(F("Gesture Matched! System Unlocked"));
+#if USE_STATS
+        statsCount(STAT_UNLOCKS);
+#endif
+        systemState = STATE_IDLE;
+        failedAttempts = 0;
+        CircuitPlayground.redLED(false);
+#if USE_ADAPTIVE_TEMPLATES
+        if (similarity >= ADAPT_CONFIDENCE && matchedTemplate >= 0) {
+            adaptTemplate(matchedTemplate);
+        }
+#endif
+        // Success animation - green spiral
+        playAnimation(successSpiral, FRAME_COUNT(successSpiral));
+    } else {
+        failedAttempts++;
+#if USE_STATS
+        statsCount(STAT_REJECTS);
+#endif
+        Serial.print(F("Gesture Did Not Match - "));
+        Serial.print(MAX_ATTEMPTS - failedAttempts);
+        Serial.println(F(" attempts remaining"));
+        
+        if (failedAttempts >= MAX_ATTEMPTS) {
+            enterLockout();
+        } else {
+            systemState = STATE_LOCKED;
+            // Failure animation - red flash
+            playAnimation(failureFlash, FRAME_COUNT(failureFlash));
+        }
+    }
+}
+
+// Normalizes the first length samples of currentSequence so the largest
+// |axis| is NORM_ONE and encodes them as template t. Done once per recording
+// so unlock attempts only normalize the live side.
+void storeTemplate(int t, int length) {
+    normalizeSequence((sample_t*)currentSequence, length, capturePeak);
+    encodeSequence((sample_t*)currentSequence, length, (template_t*)storedSequences[t]);
+    storedLengths[t] = length;
+    storedPeaks[t] = capturePeak;
+    computeFeatures(storedFeatures[t], (template_t*)storedSequences[t], length, liveScale(NORM_ONE));
+}
+
+#if USE_ADAPTIVE_TEMPLATES
+// Blends the attempt in currentSequence, already resampled by
+// matchTemplates(), into template t
+void adaptTemplate(int t) {
+    blendTemplate((template_t*)storedSequences[t], (sample_t*)currentSequence, storedLengths[t], liveScale(capturePeak), ADAPT_RATE_SHIFT);
+    storedPeaks[t] += (capturePeak - storedPeaks[t]) / (1 << ADAPT_RATE_SHIFT);
+    computeFeatures(storedFeatures[t], (template_t*)storedSequences[t], storedLengths[t], liveScale(NORM_ONE));
+    Serial.print(F("Repetition "));
+    Serial.print(t + 1);
+    Serial.println(F(" adapted to this attempt"));
+#if USE_STATS
+    statsCount(STAT_ADAPTATIONS);
+#endif
+#if USE_PERSISTENCE
+    persistTemplate();
+#endif
+}
+#endif
+
+int longestTemplate() {
+    int longest = 0;
+    for (int t = 0; t < templateCount; t++) {
+        longest = max(longest, storedLengths[t]);
+    }
+    return longest;
+}
+
+void resetStreamingMatch() {
+    for (int t = 0; t < MAX_TEMPLATES; t++) {
+        streamMatches[t] = 0;
+        streamHardMisses[t] = 0;
+    }
+    streamPeak = 0;
+}
+
+// Folds the newest live sample into the running score against every
+// template. When the live peak grows, the samples so far are rescored against
+// the new scale, so the counts always equal what compareSequences() would give
+// for the prefix received. Samples past a template's length don't count for it.
+void updateStreamingMatch() {
+    if (capturePeak == 0) {
+        return;  // Nothing to normalize against yet
+    }
+
+    int first = sampleCount - 1;
+    if (capturePeak != streamPeak) {
+        resetStreamingMatch();
+        streamPeak = capturePeak;
+        streamScale = liveScale(capturePeak);
+        first = 0;
+    }
+
+    sample_t* recorded = (sample_t*)currentSequence;
+    for (int t = 0; t < templateCount; t++) {
+        if (storedPeaks[t] == 0) {
+            continue;
+        }
+        template_t* stored = (template_t*)storedSequences[t];
+        int end = min(sampleCount, storedLengths[t]) * 3;
+        for(int i = first * 3; i < end; i++) {
+            sample_t normalizedRecorded = normalizeLive(recorded[i], streamScale);
+            sample_t storedValue = decodeSample(stored[i]);
+            if (elementMatches(normalizedRecorded, storedValue)) {
+                streamMatches[t]++;
+            } else if (elementHardMiss(normalizedRecorded, storedValue)) {
+                streamHardMisses[t]++;
+            }
+        }
+    }
+}
+
+// True once even a perfect rest of the attempt can't lift the score against
+// any template above MATCH_THRESHOLD
+bool streamingMatchHopeless() {
+    for (int t = 0; t < templateCount; t++) {
+        int total = storedLengths[t] * 3;
+        if (storedPeaks[t] != 0 && (total - streamHardMisses[t]) > MATCH_THRESHOLD * total) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Best similarity of the finished attempt over all enrolled templates
+float matchTemplates() {
+    float best = 0;
+    matchedTemplate = -1;
+#if USE_RESAMPLING
+    // Brought to the templates' length first, so each comparison costs the same
+    resampleSequence((sample_t*)currentSequence, sampleCount, (sample_t*)currentSequence, RESAMPLE_LENGTH);
+    int liveLength = RESAMPLE_LENGTH;
+#elif MATCH_ENGINE != MATCH_ENGINE_TOLERANCE
+    int liveLength = sampleCount;
+#endif
+#if MATCH_ENGINE == MATCH_ENGINE_DTW || MATCH_ENGINE == MATCH_ENGINE_NCC
+    // Templates whose feature summary is far off are skipped outright. The
+    // rest are tried most similar first, stopping at the first that clears
+    // MATCH_THRESHOLD, so a good attempt usually costs one DTW or NCC pass
+    // and an obviously wrong one none.
+    if (capturePeak == 0) {
+        return 0;
+    }
+    GestureFeatures live;
+    computeFeatures(live, (sample_t*)currentSequence, liveLength, liveScale(capturePeak));
+
+    float distance[MAX_TEMPLATES];
+    int order[MAX_TEMPLATES];
+    int candidates = 0;
+    for (int t = 0; t < templateCount; t++) {
+        if (!featuresCompatible(live, storedFeatures[t])) {
+            continue;
+        }
+#if MATCH_ENGINE == MATCH_ENGINE_DTW && !USE_RESAMPLING
+        if (abs(liveLength - storedLengths[t]) > DTW_BAND_RADIUS) {
+            continue;  // dtwSimilarity() would score it 0
+        }
+#endif
+        distance[t] = featureDistance(live, storedFeatures[t]);
+        int k = candidates++;
+        for (; k > 0 && distance[order[k - 1]] > distance[t]; k--) {
+            order[k] = order[k - 1];
+        }
+        order[k] = t;
+    }
+    if (candidates == 0) {
+        Serial.println(F("Rejected by feature pre-filter"));
+    }
+
+    for (int k = 0; k < candidates && best <= MATCH_THRESHOLD; k++) {
+        int t = order[k];
+#if MATCH_ENGINE == MATCH_ENGINE_DTW
+        float similarity = dtwSimilarity((sample_t*)currentSequence, liveLength, (template_t*)storedSequences[t], storedLengths[t], capturePeak, storedPeaks[t], matchScratch.dtw);
+#else
+        float similarity = nccSimilarity((sample_t*)currentSequence, liveLength, (template_t*)storedSequences[t], storedLengths[t], capturePeak, storedPeaks[t], matchScratch.ncc);
+#endif
+        if (similarity > best) {
+            best = similarity;
+            matchedTemplate = t;
+        }
+    }
+#elif USE_RESAMPLING
+    for (int t = 0; t < templateCount; t++) {
+        float similarity = compareSequences((sample_t*)currentSequence, (template_t*)storedSequences[t], liveLength, capturePeak, storedPeaks[t]);
+        if (similarity > best) {
+            best = similarity;
+            matchedTemplate = t;
+        }
+    }
+#else
+    // Scored incrementally during capture; equals compareSequences() on the
+    // samples received, with any that never arrived counted as misses
+    for (int t = 0; t < templateCount; t++) {
+        float similarity = (float)streamMatches[t] / (storedLengths[t] * 3);
+        if (similarity > best) {
+            best = similarity;
+            matchedTemplate = t;
+        }
+    }
+#endif
+    return best;
+}
+
+#if USE_PERSISTENCE
+// =============== PERSISTENCE =========================
+// The enrolled templates live in PERSIST_SLOT_COUNT rotating slots. Each
+// recording goes to the slot after the newest one, so wear is spread across
+// slots and the previous templates survive a power cut mid-write. Slot layout:
+//   0      magic, written last so a half-written slot never looks valid
+//   1      format version
+//   2-3    sequence number, newest wins
+//   4      template count
+//   5      sample frame, bit 0 USE_ORIENTATION_INVARIANT, bit 1 USE_RESAMPLING
+//   6-7    Fletcher-16 over bytes 0-5 and everything from byte 10 on
+//   8-9    lock state and its complement, outside the checksum so it can change alone
+//   10-    MAX_TEMPLATES entries of template length u8, template peak int16 Q7.8 m/s^2
+//   then   the templates back to back, int8 [ax,ay,az] per sample exactly
+//          as held in RAM (template_t, NORM_ONE stored as TEMPLATE_ONE)
+// One byte per value keeps several templates and slot rotation inside 1 KB.
+// The lock state byte holds the locked flag in bit 7 and failedAttempts below,
+// so power cycling can neither unlock the board nor reset a lockout.
+
+// The calibration record takes the last PERSIST_CALIBRATION_SIZE bytes,
+// past the slots, so enrolling never rewrites it:
+//   0      magic
+//   1      format version
+//   2-7    offset per axis, int16 Q7.8 m/s^2
+//   8-13   scale per axis, int16 Q1.14
+//   14-15  Fletcher-16 over bytes 0-13
+#if USE_CALIBRATION
+#define PERSIST_CALIBRATION_SIZE 16
+#else
+#define PERSIST_CALIBRATION_SIZE 0
+#endif
+#define PERSIST_CALIBRATION_ADDRESS (PERSIST_STORAGE_SIZE - PERSIST_CALIBRATION_SIZE)
+#define PERSIST_CALIBRATION_MAGIC 0x43
+#define PERSIST_CALIBRATION_VERSION 1
+
+#define PERSIST_MAGIC 0x47
+#define PERSIST_VERSION 2
+#define PERSIST_CHECKSUM_OFFSET 6
+#define PERSIST_STATE_OFFSET 8
+#define PERSIST_TEMPLATES_OFFSET 10
+#define PERSIST_HEADER_SIZE (PERSIST_TEMPLATES_OFFSET + MAX_TEMPLATES * 3)
+#define PERSIST_SLOT_SIZE (PERSIST_HEADER_SIZE + MAX_TEMPLATES * TEMPLATE_LENGTH * 3)
+#define PERSIST_FRAME (USE_ORIENTATION_INVARIANT | USE_RESAMPLING << 1)
+#define PERSIST_SLOT_COUNT ((PERSIST_STORAGE_SIZE - PERSIST_CALIBRATION_SIZE) / PERSIST_SLOT_SIZE)
+#define PERSIST_STATE_LOCKED 0x80
+
+#if PERSIST_SLOT_COUNT < 1
+#error "TEMPLATE_LENGTH * MAX_TEMPLATES is too large for the persistent storage, build with USE_PERSISTENCE 0"
+#endif
+
+#if defined(__AVR__)
+#define persistReady() eeprom_is_ready()
+#define persistCommit()
+#else
+#define persistReady() true
+#define persistCommit() EEPROM.commit()
+#endif
+
+int persistActiveSlot = -1;  // Slot holding the current template, -1 if none
+uint16_t persistSequence = 0;
+uint8_t persistedState = 0;  // Lock state as last written to the active slot
+uint8_t persistStateStep = 0;  // 1 while the complement byte is still to be written
+
+// Background slot write
+int persistJobSlot = -1;
+int persistJobOffset = 0;
+int persistJobSize = 0;
+uint8_t persistJobHeader[PERSIST_HEADER_SIZE];
+
+#if USE_CALIBRATION
+// Background calibration record write, same steps as a slot
+bool persistCalibrationJob = false;
+int persistCalibrationOffset = 0;
+uint8_t persistCalibrationRecord[PERSIST_CALIBRATION_SIZE];
+#endif
+
+int persistSlotAddress(int slot) {
+    return slot * PERSIST_SLOT_SIZE;
+}
+
+uint8_t lockStateByte() {
+    return (systemLocked() ? PERSIST_STATE_LOCKED : 0) | (uint8_t)failedAttempts;
+}
+
+// Element index of the templates laid end to end, in the stored format
+int8_t persistValue(int index) {
+    int t = 0;
+    while (index >= storedLengths[t] * 3) {
+        index -= storedLengths[t] * 3;
+        t++;
+    }
+    return ((template_t*)storedSequences[t])[index];  // Already in the stored format
+}
+
+void fletcherAdd(uint16_t& sum1, uint16_t& sum2, uint8_t value) {
+    sum1 = (sum1 + value) % 255;
+    sum2 = (sum2 + sum1) % 255;
+}
+
+// Byte at offset in the image of the slot being written
+uint8_t persistJobByte(int offset) {
+    if (offset < PERSIST_HEADER_SIZE) {
+        return persistJobHeader[offset];
+    }
+    return (uint8_t)persistValue(offset - PERSIST_HEADER_SIZE);
+}
+
+// Queues the enrolled templates for writing to the next slot
+void persistTemplate() {
+    int slot = (persistActiveSlot + 1) % PERSIST_SLOT_COUNT;
+    uint16_t sequence = persistSequence + 1;
+    uint8_t state = lockStateByte();
+
+    uint8_t* header = persistJobHeader;
+    header[0] = PERSIST_MAGIC;
+    header[1] = PERSIST_VERSION;
+    header[2] = (uint8_t)sequence;
+    header[3] = (uint8_t)(sequence >> 8);
+    header[4] = (uint8_t)templateCount;
+    header[5] = PERSIST_FRAME;
+    header[PERSIST_STATE_OFFSET] = state;
+    header[PERSIST_STATE_OFFSET + 1] = (uint8_t)~state;
+
+    persistJobSize = PERSIST_HEADER_SIZE;
+    for (int t = 0; t < MAX_TEMPLATES; t++) {
+        uint8_t* entry = header + PERSIST_TEMPLATES_OFFSET + t * 3;
+        int length = t < templateCount ? storedLengths[t] : 0;
+#if USE_FIXED_POINT
+        int16_t peak = t < templateCount ? storedPeaks[t] : 0;
+#else
+        int16_t peak = t < templateCount ? (int16_t)lround(storedPeaks[t] * 256) : 0;
+#endif
+        entry[0] = (uint8_t)length;
+        entry[1] = (uint8_t)peak;
+        entry[2] = (uint8_t)(peak >> 8);
+        persistJobSize += length * 3;
+    }
+
+    uint16_t sum1 = 0;
+    uint16_t sum2 = 0;
+    for (int i = 0; i < PERSIST_CHECKSUM_OFFSET; i++) {
+        fletcherAdd(sum1, sum2, header[i]);
+    }
+    for (int i = PERSIST_TEMPLATES_OFFSET; i < persistJobSize; i++) {
+        fletcherAdd(sum1, sum2, persistJobByte(i));
+    }
+    header[PERSIST_CHECKSUM_OFFSET] = (uint8_t)sum1;
+    header[PERSIST_CHECKSUM_OFFSET + 1] = (uint8_t)sum2;
+
+    persistJobSlot = slot;
+    persistJobOffset = -1;  // Step -1 clears the magic byte before anything else
+}
+
+void cancelPersistJob() {
+    persistJobSlot = -1;
+}
+
+void servicePersistence() {
+    if (!persistReady()) {
+        return;
+    }
+
+    if (persistJobSlot >= 0) {
+        int base = persistSlotAddress(persistJobSlot);
+        if (persistJobOffset < 0) {
+            EEPROM.update(base, 0);
+            persistJobOffset = 1;
+        } else if (persistJobOffset < persistJobSize) {
+            EEPROM.update(base + persistJobOffset, persistJobByte(persistJobOffset));
+            persistJobOffset++;
+        } else {
+            EEPROM.update(base, PERSIST_MAGIC);
+            persistCommit();
+            persistActiveSlot = persistJobSlot;
+            persistSequence = persistJobHeader[2] | (persistJobHeader[3] << 8);
+            persistedState = persistJobHeader[PERSIST_STATE_OFFSET];
+            persistJobSlot = -1;
+            Serial.print(F("Template saved to slot "));
+            Serial.println(persistActiveSlot);
+        }
+        return;
+    }
+
+#if USE_CALIBRATION
+    if (persistCalibrationJob) {
+        if (persistCalibrationOffset < 0) {
+            EEPROM.update(PERSIST_CALIBRATION_ADDRESS, 0);
+            persistCalibrationOffset = 1;
+        } else if (persistCalibrationOffset < PERSIST_CALIBRATION_SIZE) {
+            EEPROM.update(PERSIST_CALIBRATION_ADDRESS + persistCalibrationOffset, persistCalibrationRecord[persistCalibrationOffset]);
+            persistCalibrationOffset++;
+        } else {
+            EEPROM.update(PERSIST_CALIBRATION_ADDRESS, PERSIST_CALIBRATION_MAGIC);
+            persistCommit();
+            persistCalibrationJob = false;
+            Serial.println(F("Calibration saved"));
+        }
+        return;
+    }
+#endif
+
+    // Keep the lock state of the active slot in step with RAM
+    if (persistActiveSlot < 0) {
+        return;
+    }
+    int address = persistSlotAddress(persistActiveSlot) + PERSIST_STATE_OFFSET;
+    if (persistStateStep == 1) {
+        EEPROM.update(address + 1, (uint8_t)~persistedState);
+        persistCommit();
+        persistStateStep = 0;
+    } else if (lockStateByte() != persistedState) {
+        persistedState = lockStateByte();
+        EEPROM.update(address, persistedState);
+        persistStateStep = 1;
+    }
+}
+
+// Reads and verifies one slot straight into the templates. Returns false if
+// the slot is empty or damaged, leaving templateCount at 0.
+bool loadSlot(int slot) {
+    int base = persistSlotAddress(slot);
+    int count = EEPROM.read(base + 4);
+    templateCount = 0;
+    if (count < 1 || count > MAX_TEMPLATES) {
+        return false;
+    }
+
+    uint16_t sum1 = 0;
+    uint16_t sum2 = 0;
+    for (int i = 0; i < PERSIST_CHECKSUM_OFFSET; i++) {
+        fletcherAdd(sum1, sum2, EEPROM.read(base + i));
+    }
+    for (int i = PERSIST_TEMPLATES_OFFSET; i < PERSIST_HEADER_SIZE; i++) {
+        fletcherAdd(sum1, sum2, EEPROM.read(base + i));
+    }
+
+    int address = base + PERSIST_HEADER_SIZE;
+    for (int t = 0; t < count; t++) {
+        int entry = base + PERSIST_TEMPLATES_OFFSET + t * 3;
+        int length = EEPROM.read(entry);
+        if (length < 1 || length > TEMPLATE_LENGTH) {
+            return false;
+        }
+        template_t* stored = (template_t*)storedSequences[t];
+        for (int i = 0; i < length * 3; i++) {
+            uint8_t value = EEPROM.read(address++);
+            fletcherAdd(sum1, sum2, value);
+            stored[i] = (template_t)value;
+        }
+
+        int16_t peak = (int16_t)(EEPROM.read(entry + 1) | (EEPROM.read(entry + 2) << 8));
+#if USE_FIXED_POINT
+        storedPeaks[t] = peak;
+#else
+        storedPeaks[t] = peak / 256.0;
+#endif
+        storedLengths[t] = length;
+        computeFeatures(storedFeatures[t], stored, length, liveScale(NORM_ONE));
+    }
+
+    if (EEPROM.read(base + PERSIST_CHECKSUM_OFFSET) != sum1 || EEPROM.read(base + PERSIST_CHECKSUM_OFFSET + 1) != sum2) {
+        return false;
+    }
+    templateCount = count;
+    return true;
+}
+
+#if USE_CALIBRATION
+// Queues the calibration for servicePersistence(), which writes it a byte per
+// pass like a slot, magic last, after any template write in progress
+void saveCalibration() {
+    uint8_t* record = persistCalibrationRecord;
+    record[0] = PERSIST_CALIBRATION_MAGIC;
+    record[1] = PERSIST_CALIBRATION_VERSION;
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        int16_t offset = calOffset[a];
+        int16_t scale = calScale[a];
+#else
+        int16_t offset = (int16_t)lround(calOffset[a] * 256);
+        int16_t scale = (int16_t)lround(calScale[a] * 16384);
+#endif
+        record[2 + a * 2] = (uint8_t)offset;
+        record[3 + a * 2] = (uint8_t)(offset >> 8);
+        record[8 + a * 2] = (uint8_t)scale;
+        record[9 + a * 2] = (uint8_t)(scale >> 8);
+    }
+    uint16_t sum1 = 0;
+    uint16_t sum2 = 0;
+    for (int i = 0; i < PERSIST_CALIBRATION_SIZE - 2; i++) {
+        fletcherAdd(sum1, sum2, record[i]);
+    }
+    record[PERSIST_CALIBRATION_SIZE - 2] = (uint8_t)sum1;
+    record[PERSIST_CALIBRATION_SIZE - 1] = (uint8_t)sum2;
+
+    persistCalibrationJob = true;
+    persistCalibrationOffset = -1;  // Step -1 clears the magic byte before anything else
+}
+
+void loadCalibration() {
+    uint8_t record[PERSIST_CALIBRATION_SIZE];
+    uint16_t sum1 = 0;
+    uint16_t sum2 = 0;
+    for (int i = 0; i < PERSIST_CALIBRATION_SIZE; i++) {
+        record[i] = EEPROM.read(PERSIST_CALIBRATION_ADDRESS + i);
+        if (i < PERSIST_CALIBRATION_SIZE - 2) {
+            fletcherAdd(sum1, sum2, record[i]);
+        }
+    }
+    if (record[0] != PERSIST_CALIBRATION_MAGIC || record[1] != PERSIST_CALIBRATION_VERSION ||
+        record[PERSIST_CALIBRATION_SIZE - 2] != sum1 || record[PERSIST_CALIBRATION_SIZE - 1] != sum2) {
+        return;  // Never calibrated, or damaged: stay uncalibrated
+    }
+    for (int a = 0; a < 3; a++) {
+        int16_t offset = record[2 + a * 2] | (record[3 + a * 2] << 8);
+        int16_t scale = record[8 + a * 2] | (record[9 + a * 2] << 8);
+#if USE_FIXED_POINT
+        calOffset[a] = offset;
+        calScale[a] = scale;
+#else
+        calOffset[a] = offset / 256.0f;
+        calScale[a] = scale / 16384.0f;
+#endif
+    }
+    Serial.println(F("Restored calibration"));
+}
+#endif
+
+// Restores the newest valid template and the lock state at boot. Only the
+// chosen slot's payload is read, so this costs a few hundred EEPROM reads.
+void loadPersistedState() {
+#if USE_CALIBRATION
+    loadCalibration();
+#endif
+    bool tried[PERSIST_SLOT_COUNT] = {false};
+
+    // Newest first, falling back to older slots if the checksum fails
+    for (int attempt = 0; attempt < PERSIST_SLOT_COUNT; attempt++) {
+        int newest = -1;
+        uint16_t newestSequence = 0;
+        for (int slot = 0; slot < PERSIST_SLOT_COUNT; slot++) {
+            int base = persistSlotAddress(slot);
+            if (tried[slot] || EEPROM.read(base) != PERSIST_MAGIC || EEPROM.read(base + 1) != PERSIST_VERSION) {
+                continue;
+            }
+            if (EEPROM.read(base + 5) != PERSIST_FRAME) {
+                continue;  // Recorded in another sample frame or length, would never match
+            }
+            int count = EEPROM.read(base + 4);
+            if (count < 1 || count > MAX_TEMPLATES) {
+                continue;
+            }
+            uint16_t sequence = EEPROM.read(base + 2) | (EEPROM.read(base + 3) << 8);
+            if (newest < 0 || (int16_t)(sequence - newestSequence) > 0) {
+                newest = slot;
+                newestSequence = sequence;
+            }
+        }
+        if (newest < 0) {
+            break;
+        }
+        tried[newest] = true;
+
+        if (loadSlot(newest)) {
+            persistActiveSlot = newest;
+            persistSequence = newestSequence;
+            break;
+        }
+        Serial.print(F("Discarding damaged template slot "));
+        Serial.println(newest);
+    }
+
+    if (persistActiveSlot < 0) {
+        return;
+    }
+
+    int address = persistSlotAddress(persistActiveSlot) + PERSIST_STATE_OFFSET;
+    uint8_t state = EEPROM.read(address);
+    if ((uint8_t)~state != EEPROM.read(address + 1)) {
+        state = PERSIST_STATE_LOCKED;  // Damaged state, fail safe
+    }
+    persistedState = state;
+    systemState = (state & PERSIST_STATE_LOCKED) ? STATE_LOCKED : STATE_IDLE;
+    failedAttempts = min(state & ~PERSIST_STATE_LOCKED, MAX_ATTEMPTS);
+
+    Serial.print(F("Restored "));
+    Serial.print(templateCount);
+    Serial.println(systemLocked() ? F(" templates, system locked") : F(" templates"));
+    CircuitPlayground.redLED(systemLocked());
+    if (systemLocked() && failedAttempts >= MAX_ATTEMPTS) {
+        enterLockout();  // The lockout restarts rather than being skipped
+    }
+}
+#endif
+
+#if USE_STATS
+// =============== STATS =========================
+// Fixed-size counters for watching devices in the field. Every update is a
+// saturating add, so counting costs the same on every pass and a counter
+// that overflows sticks at its maximum instead of wrapping. Per-attempt
+// counters are 16-bit; the loop histogram is bumped on every pass, up to a
+// few thousand times a second, so its bins are 32-bit. Serial
+// commands, one byte each:
+//   s   dump everything as "stat <name> <value>" lines, ending in "stat end"
+//   r   reset everything to zero
+// The dump goes out one line per loop() pass and only while Serial has room
+// for it, so it never blocks and never splits a telemetry frame. Histogram
+// bins are named by their lower bound: score_ge_<percent> counts attempts
+// scoring at least that, loop_us_ge_<us> passes taking at least that long.
+
+// Names and the table of them both live in flash, read with pgm_read_ptr()
+const char statNameRecordings[] PROGMEM = "recordings";
+const char statNameAttempts[] PROGMEM = "attempts";
+const char statNameUnlocks[] PROGMEM = "unlocks";
+const char statNameRejects[] PROGMEM = "rejects";
+const char statNameEmptyAttempts[] PROGMEM = "empty_attempts";
+const char statNameEarlyRejects[] PROGMEM = "early_rejects";
+const char statNameLockouts[] PROGMEM = "lockouts";
+const char statNameAborts[] PROGMEM = "aborts";
+const char statNameAdaptations[] PROGMEM = "adaptations";
+const char statNameDroppedSamples[] PROGMEM = "dropped_samples";
+const char statNameMissedSamples[] PROGMEM = "missed_samples";
+const char statNameExportDropped[] PROGMEM = "export_dropped";
+const char* const statNames[STAT_COUNT] PROGMEM = {
+    statNameRecordings, statNameAttempts, statNameUnlocks, statNameRejects,
+    statNameEmptyAttempts, statNameEarlyRejects, statNameLockouts, statNameAborts,
+    statNameAdaptations, statNameDroppedSamples, statNameMissedSamples,
+    statNameExportDropped
+};
+
+uint16_t statCounters[STAT_COUNT];
+uint16_t statScoreBins[STATS_SCORE_BINS];
+uint32_t statLoopBins[STATS_LOOP_BINS];
+uint16_t statCaptures = 0;
+uint32_t statCaptureMsTotal = 0;
+uint16_t statCaptureMsMax = 0;
+uint16_t statLoopUsMax = 0;
+int statDumpLine = -1;  // Next dump line to write, -1 when not dumping
+
+void statAdd(uint16_t& counter, uint32_t amount) {
+    uint32_t sum = counter + amount;
+    counter = sum > 0xFFFF ? 0xFFFF : sum;
+}
+
+void statAdd(uint32_t& counter, uint32_t amount) {
+    counter = counter > 0xFFFFFFFFUL - amount ? 0xFFFFFFFFUL : counter + amount;
+}
+
+void statMax(uint16_t& counter, uint32_t value) {
+    if (value > counter) {
+        counter = value > 0xFFFF ? 0xFFFF : value;
+    }
+}
+
+void statsCount(StatCounter counter) {
+    statAdd(statCounters[counter], 1);
+}
+
+// Called once per finished capture, before it is judged
+void statsCapture(unsigned long durationMs) {
+    statAdd(statCaptures, 1);
+    statCaptureMsTotal += durationMs;
+    statMax(statCaptureMsMax, durationMs);
+    statAdd(statCounters[STAT_DROPPED_SAMPLES], droppedSamples);
+    statAdd(statCounters[STAT_MISSED_SAMPLES], missedSamples);
+}
+
+void statsScore(float similarity) {
+    statsCount(STAT_ATTEMPTS);
+    int bin = similarity * STATS_SCORE_BINS;
+    statAdd(statScoreBins[constrain(bin, 0, STATS_SCORE_BINS - 1)], 1);
+}
+
+void statsLoop(unsigned long latencyUs) {
+    statMax(statLoopUsMax, latencyUs);
+    int bin = 0;
+    for (unsigned long rest = latencyUs >> 4; rest != 0 && bin < STATS_LOOP_BINS - 1; rest >>= 1) {
+        bin++;
+    }
+    statAdd(statLoopBins[bin], 1);
+}
+
+void resetStats() {
+    memset(statCounters, 0, sizeof(statCounters));
+    memset(statScoreBins, 0, sizeof(statScoreBins));
+    memset(statLoopBins, 0, sizeof(statLoopBins));
+    statCaptures = 0;
+    statCaptureMsTotal = 0;
+    statCaptureMsMax = 0;
+    statLoopUsMax = 0;
+    Serial.println(F("Stats reset"));
+}
+
+void printStat(const __FlashStringHelper* name, unsigned long value) {
+    Serial.print(F("stat "));
+    Serial.print(name);
+    Serial.print(' ');
+    Serial.println(value);
+}
+
+void printStatBin(const __FlashStringHelper* name, unsigned long bound, unsigned long value) {
+    Serial.print(F("stat "));
+    Serial.print(name);
+    Serial.print(bound);
+    Serial.print(' ');
+    Serial.println(value);
+}
+
+// Writes dump line `line`, returns false past the last one
+bool printStatLine(int line) {
+    if (line < STAT_COUNT) {
+        printStat((const __FlashStringHelper*)pgm_read_ptr(statNames + line), statCounters[line]);
+        return true;
+    }
+    line -= STAT_COUNT;
+    switch (line) {
+    case 0:
+        printStat(F("capture_ms_mean"), statCaptures > 0 ? statCaptureMsTotal / statCaptures : 0);
+        return true;
+    case 1:
+        printStat(F("capture_ms_max"), statCaptureMsMax);
+        return true;
+    case 2:
+        printStat(F("loop_us_max"), statLoopUsMax);
+        return true;
+    }
+    line -= 3;
+    if (line < STATS_SCORE_BINS) {
+        printStatBin(F("score_ge_"), line * (100 / STATS_SCORE_BINS), statScoreBins[line]);
+        return true;
+    }
+    line -= STATS_SCORE_BINS;
+    if (line < STATS_LOOP_BINS) {
+        printStatBin(F("loop_us_ge_"), line == 0 ? 0 : 8UL << line, statLoopBins[line]);
+        return true;
+    }
+    Serial.println(F("stat end"));
+    return false;
+}
+
+void startStatsDump() {
+    statDumpLine = 0;
+}
+
+void serviceStats() {
+    if (statDumpLine < 0 || Serial.availableForWrite() < STATS_LINE_MAX) {
+        return;
+    }
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    if (telemetryPending()) {
+        return;  // A frame may be half written
+    }
+#endif
+    statDumpLine = printStatLine(statDumpLine) ? statDumpLine + 1 : -1;
+}
+#endif
+
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY || USE_CAPTURE_EXPORT
+// Closes every telemetry and export frame
+uint8_t crc8(const uint8_t* data, uint8_t length) {
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+#endif
+
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+// =============== TELEMETRY =========================
+// Each frame is COBS encoded and terminated by a 0x00 byte, so a host can
+// resync on any zero even with the plain text status lines in between.
+// Decoded frame layout (little-endian):
+//   0     frame type
+//   1-2   sequence number, gaps mean frames were dropped
+//   3-    payload
+//   last  CRC-8 (poly 0x07) over everything before it
+// Payloads:
+//   TELEMETRY_BEGIN   mode (1 = record, 2 = check)
+//   TELEMETRY_SAMPLE  index u8, ax ay az int16 Q7.8 m/s^2
+//   TELEMETRY_END     mode, sample count u8, similarity u16 in 1/10000
+// Frames are queued in a small ring and handed to Serial only as fast as it
+// can accept them without blocking. When the ring is full the frame is
+// dropped; the sequence number still advances, so the drop shows up on the host.
+
+#define TELEMETRY_BEGIN 0x01
+#define TELEMETRY_SAMPLE 0x02
+#define TELEMETRY_END 0x03
+#define TELEMETRY_MAX_FRAME 16
+
+uint8_t telemetryBuffer[TELEMETRY_BUFFER_SIZE];
+uint8_t telemetryHead = 0;
+uint8_t telemetryTail = 0;
+uint16_t telemetrySequence = 0;
+uint16_t telemetryDropped = 0;
+
+void telemetryPutByte(uint8_t value) {
+    telemetryBuffer[telemetryHead & (TELEMETRY_BUFFER_SIZE - 1)] = value;
+    telemetryHead++;
+}
+
+// Adds sequence number and CRC, then COBS-encodes frame into the transmit
+// ring. frame must have room for the CRC byte after length.
+void telemetrySend(uint8_t* frame, uint8_t length) {
+    uint16_t sequence = telemetrySequence++;
+    frame[1] = (uint8_t)sequence;
+    frame[2] = (uint8_t)(sequence >> 8);
+    frame[length] = crc8(frame, length);
+    length++;
+
+    // COBS adds one byte for frames under 254 bytes, plus the delimiter
+    uint8_t used = telemetryHead - telemetryTail;
+    if (TELEMETRY_BUFFER_SIZE - used < length + 2) {
+        telemetryDropped++;
+        return;
+    }
+
+    // Each block is a code byte giving the distance to the next zero,
+    // followed by the non-zero bytes in between
+    uint8_t codeIndex = telemetryHead;
+    uint8_t code = 1;
+    telemetryPutByte(0);  // Placeholder for the first code byte
+    for (uint8_t i = 0; i < length; i++) {
+        if (frame[i] == 0) {
+            telemetryBuffer[codeIndex & (TELEMETRY_BUFFER_SIZE - 1)] = code;
+            codeIndex = telemetryHead;
+            code = 1;
+            telemetryPutByte(0);
+        } else {
+            telemetryPutByte(frame[i]);
+            code++;
+        }
+    }
+    telemetryBuffer[codeIndex & (TELEMETRY_BUFFER_SIZE - 1)] = code;
+    telemetryPutByte(0);  // Frame delimiter
+}
+
+uint8_t telemetryMode() {
+    return systemState == STATE_RECORDING ? 1 : 2;
+}
+
+void telemetryCaptureBegin() {
+    uint8_t frame[TELEMETRY_MAX_FRAME];
+    frame[0] = TELEMETRY_BEGIN;
+    frame[3] = telemetryMode();
+    telemetrySend(frame, 4);
+}
+
+void telemetrySample(int index, const sample_t* sample) {
+    if (index % TELEMETRY_DECIMATION != 0) {
+        return;
+    }
+
+    uint8_t frame[TELEMETRY_MAX_FRAME];
+    frame[0] = TELEMETRY_SAMPLE;
+    frame[3] = (uint8_t)index;
+    for (int a = 0; a < 3; a++) {
+#if USE_FIXED_POINT
+        int16_t value = sample[a];
+#else
+        int16_t value = (int16_t)lround(sample[a] * 256);
+#endif
+        frame[4 + a * 2] = (uint8_t)value;
+        frame[5 + a * 2] = (uint8_t)(value >> 8);
+    }
+    telemetrySend(frame, 10);
+}
+
+void telemetryCaptureEnd(float similarity) {
+    uint16_t score = similarity * 10000;
+    uint8_t frame[TELEMETRY_MAX_FRAME];
+    frame[0] = TELEMETRY_END;
+    frame[3] = telemetryMode();
+    frame[4] = (uint8_t)sampleCount;
+    frame[5] = (uint8_t)score;
+    frame[6] = (uint8_t)(score >> 8);
+    telemetrySend(frame, 7);
+}
+
+// Writes as much queued telemetry as Serial accepts without blocking
+bool telemetryPending() {
+    return telemetryHead != telemetryTail;
+}
+
+void drainTelemetry() {
+    uint8_t queued = telemetryHead - telemetryTail;
+    if (queued == 0) {
+        return;
+    }
+
+    int space = Serial.availableForWrite();
+    if (space <= 0) {
+        return;
+    }
+
+    // Stop at the end of the ring so each write is one contiguous block
+    uint8_t start = telemetryTail & (TELEMETRY_BUFFER_SIZE - 1);
+    uint8_t count = min(queued, (uint8_t)(TELEMETRY_BUFFER_SIZE - start));
+    if (count > space) {
+        count = space;
+    }
+    Serial.write(telemetryBuffer + start, count);
+    telemetryTail += count;
+}
+#endif
+
+#if USE_CAPTURE_EXPORT
+// =============== EXPORT =========================
+// Every finished recording and attempt is queued in exportBuffer, each as
+//   0     mode (1 = record, 2 = check)
+//   1     sample count u8
+//   2-3   similarity u16 in 1/10000, 0 for recordings
+//   4-5   peak int16 Q7.8 m/s^2, the largest |axis|
+//   6-    count samples of int8 [ax,ay,az], scaled so peak is 127
+// which is half the size of the Q7.8 samples and loses at most peak/254.
+// Captures that don't fit are dropped and counted. While the board is idle
+// and unlocked the queue goes out one frame per loop() pass, framed like
+// TELEMETRY (COBS, 0x00 delimiter, sequence number, CRC-8) so the replay
+// tool reads a saved export like any telemetry log:
+//   EXPORT_BEGIN  mode, sample count u8, similarity u16, peak int16
+//   EXPORT_DATA   first sample index u8, up to EXPORT_CHUNK_SAMPLES samples
+// Nothing is sent while capturing, and nothing while locked, since the
+// recordings are the unlock gesture itself. On the Bluefruit the frames go
+// out over BLE UART to whichever central is connected with notifications on;
+// elsewhere over Serial.
+
+#define EXPORT_BEGIN 0x04
+#define EXPORT_DATA 0x05
+#define EXPORT_RECORD_HEADER 6
+#define EXPORT_MAX_FRAME (4 + EXPORT_CHUNK_SAMPLES * 3 + 1)
+#define EXPORT_MAX_ENCODED (EXPORT_MAX_FRAME + 2)  // COBS code byte and delimiter
+#if EXPORT_MAX_FRAME > 254
+#error "EXPORT_CHUNK_SAMPLES is too large for a single COBS block"
+#endif
+
+uint8_t exportBuffer[EXPORT_BUFFER_SIZE];
+int exportUsed = 0;  // Bytes of queued records
+int exportRecordStart = 0;  // Record being sent
+int exportNextSample = -1;  // Next sample of it to send, -1 before its EXPORT_BEGIN
+uint16_t exportSequence = 0;
+
+#if HAVE_BLE_UART
+BLEUart bleUart;
+
+// Advertises the Nordic UART service under the board's name for the
+// collecting central to connect to
+void setupExport() {
+    Bluefruit.begin();
+    Bluefruit.setName("GestureLock");
+    bleUart.begin();
+    Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE);
+    Bluefruit.Advertising.addTxPower();
+    Bluefruit.Advertising.addService(bleUart);
+    Bluefruit.ScanResponse.addName();
+    Bluefruit.Advertising.restartOnDisconnect(true);
+    Bluefruit.Advertising.start(0);  // Advertise until connected
+}
+
+bool exportPortReady() {
+    return Bluefruit.connected() && bleUart.notifyEnabled();
+}
+
+#define EXPORT_PORT bleUart
+#else
+void setupExport() {
+}
+
+// Don't split a telemetry frame, and never wait on the port
+bool exportPortReady() {
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    if (telemetryPending()) {
+        return false;
+    }
+#endif
+    return Serial.availableForWrite() >= EXPORT_MAX_ENCODED;
+}
+
+#define EXPORT_PORT Serial
+#endif
+
+// Queues the capture in currentSequence. Returns the record's offset for
+// exportScore(), or -1 if it was dropped.
+int exportCapture(uint8_t mode) {
+    int size = EXPORT_RECORD_HEADER + sampleCount * 3;
+    if (exportUsed + size > EXPORT_BUFFER_SIZE) {
+#if USE_STATS
+        statsCount(STAT_EXPORT_DROPPED);
+#endif
+        return -1;
+    }
+
+    int record = exportUsed;
+    uint8_t* header = exportBuffer + record;
+#if USE_FIXED_POINT
+    int16_t peak = capturePeak;
+#else
+    int16_t peak = (int16_t)lround(capturePeak * 256);
+#endif
+    header[0] = mode;
+    header[1] = (uint8_t)sampleCount;
+    header[2] = 0;
+    header[3] = 0;
+    header[4] = (uint8_t)peak;
+    header[5] = (uint8_t)(peak >> 8);
+
+    // Same scaling as the templates, relative to this capture's own peak
+    norm_scale_t scale = liveScale(capturePeak);
+    const sample_t* samples = (sample_t*)currentSequence;
+    for (int i = 0; i < sampleCount * 3; i++) {
+        header[EXPORT_RECORD_HEADER + i] = (uint8_t)encodeSample(capturePeak == 0 ? 0 : normalizeLive(samples[i], scale));
+    }
+    exportUsed += size;
+    return record;
+}
+
+void exportScore(int record, float similarity) {
+    if (record < 0) {
+        return;
+    }
+    uint16_t score = similarity * 10000;
+    exportBuffer[record + 2] = (uint8_t)score;
+    exportBuffer[record + 3] = (uint8_t)(score >> 8);
+}
+
+// Adds sequence number and CRC to frame and writes it COBS encoded
+void exportSend(uint8_t* frame, uint8_t length) {
+    frame[1] = (uint8_t)exportSequence;
+    frame[2] = (uint8_t)(exportSequence >> 8);
+    exportSequence++;
+    frame[length] = crc8(frame, length);
+    length++;
+
+    uint8_t encoded[EXPORT_MAX_ENCODED];
+    uint8_t codeIndex = 0;
+    uint8_t out = 1;
+    uint8_t code = 1;
+    for (uint8_t i = 0; i < length; i++) {
+        if (frame[i] == 0) {
+            encoded[codeIndex] = code;
+            codeIndex = out++;
+            code = 1;
+        } else {
+            encoded[out++] = frame[i];
+            code++;
+        }
+    }
+    encoded[codeIndex] = code;
+    encoded[out++] = 0;  // Frame delimiter
+    EXPORT_PORT.write(encoded, out);
+}
+
+void serviceExport() {
+    if (exportRecordStart >= exportUsed || systemState != STATE_IDLE || !exportPortReady()) {
+        return;
+    }
+
+    const uint8_t* record = exportBuffer + exportRecordStart;
+    int count = record[1];
+    uint8_t frame[EXPORT_MAX_FRAME];
+    if (exportNextSample < 0) {
+        frame[0] = EXPORT_BEGIN;
+        memcpy(frame + 3, record, EXPORT_RECORD_HEADER);
+        exportSend(frame, 3 + EXPORT_RECORD_HEADER);
+        exportNextSample = 0;
+        return;
+    }
+
+    int chunk = min(count - exportNextSample, EXPORT_CHUNK_SAMPLES);
+    frame[0] = EXPORT_DATA;
+    frame[3] = (uint8_t)exportNextSample;
+    memcpy(frame + 4, record + EXPORT_RECORD_HEADER + exportNextSample * 3, chunk * 3);
+    exportSend(frame, 4 + chunk * 3);
+    exportNextSample += chunk;
+
+    if (exportNextSample >= count) {
+        exportRecordStart += EXPORT_RECORD_HEADER + count * 3;
+        exportNextSample = -1;
+        if (exportRecordStart >= exportUsed) {
+            exportRecordStart = 0;  // All sent, start the batch over
+            exportUsed = 0;
+        }
+    }
+}
+#endif
+
+#if USE_BENCHMARK
+// =============== BENCHMARK =========================
+// Times each pipeline stage BENCH_RUNS times and prints min/max/mean in
+// microseconds plus the mean in CPU cycles, then free SRAM. Matchers run on a
+// synthetic gesture and, if one is enrolled, on the first template, each
+// compared against itself. Stages share the real globals, so this only runs
+// at boot before anything is captured. micros() ticks in 4 us steps on the
+// Classic, so the mean (from the total) is finer than min and max.
+
+volatile float benchSink;  // Keeps results from being optimized away
+const sample_t* benchSequence;  // Live side of the matchers
+const template_t* benchTemplate;  // The same gesture, encoded
+int benchLength;
+sample_t benchPeak;
+AccelSample benchSample;
+
+// Smooth normalized three-axis wave in currentSequence
+void benchSynthetic(int length) {
+    for (int i = 0; i < length; i++) {
+        for (int a = 0; a < 3; a++) {
+            currentSequence[i][a] = NORM_ONE * sin(i * 0.25 + a) * 0.999;
+        }
+    }
+}
+
+void benchPrepareResample() {
+    benchSynthetic(SEQUENCE_LENGTH);
+}
+
+void benchTakeSample() {
+    takeSample(benchSample);
+}
+
+void benchFilterSample() {
+    filterSample(benchSample);
+}
+
+void benchLogLine() {
+    Serial.print(F("Check Sample "));
+    Serial.print(SEQUENCE_LENGTH - 1);
+    Serial.print(F(": X="));
+    Serial.print(sampleToFloat(benchSample.axis[0]), 2);
+    Serial.print(F(" Y="));
+    Serial.print(sampleToFloat(benchSample.axis[1]), 2);
+    Serial.print(F(" Z="));
+    Serial.println(sampleToFloat(benchSample.axis[2]), 2);
+}
+
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+void benchPrepareTelemetry() {
+    telemetryTail = telemetryHead;  // Always measure an enqueue, never a drop
+}
+
+void benchTelemetrySample() {
+    telemetrySample(0, benchSample.axis);
+}
+#endif
+
+void benchCompare() {
+    benchSink = compareSequences((sample_t*)benchSequence, benchTemplate, benchLength, benchPeak, benchPeak);
+}
+
+void benchDtw() {
+    benchSink = dtwSimilarity((sample_t*)benchSequence, benchLength, benchTemplate, benchLength, benchPeak, benchPeak, matchScratch.dtw);
+}
+
+void benchNcc() {
+    benchSink = nccSimilarity((sample_t*)benchSequence, benchLength, benchTemplate, benchLength, benchPeak, benchPeak, matchScratch.ncc);
+}
+
+void benchFeatures() {
+    GestureFeatures features;
+    computeFeatures(features, benchSequence, benchLength, liveScale(benchPeak));
+    benchSink = features.spread[0];
+}
+
+#if USE_RESAMPLING
+void benchResample() {
+    resampleSequence((sample_t*)currentSequence, SEQUENCE_LENGTH, (sample_t*)currentSequence, RESAMPLE_LENGTH);
+}
+#endif
+
+void benchStage(const __FlashStringHelper* name, void (*stage)(), void (*prepare)()) {
+    unsigned long fastest = 0xFFFFFFFFUL;
+    unsigned long slowest = 0;
+    unsigned long total = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        if (prepare != NULL) {
+            prepare();
+        }
+        unsigned long start = micros();
+        stage();
+        unsigned long elapsed = micros() - start;
+        fastest = min(fastest, elapsed);
+        slowest = max(slowest, elapsed);
+        total += elapsed;
+    }
+    float mean = (float)total / BENCH_RUNS;
+    Serial.print(F("bench "));
+    Serial.print(name);
+    Serial.print(F(": min "));
+    Serial.print(fastest);
+    Serial.print(F(" us, max "));
+    Serial.print(slowest);
+    Serial.print(F(" us, mean "));
+    Serial.print(mean, 1);
+    Serial.print(F(" us, ~"));
+    Serial.print((unsigned long)(mean * (F_CPU / 1000000UL)));
+    Serial.println(F(" cycles"));
+}
+
+#if defined(__arm__)
+extern "C" char* sbrk(int increment);
+#endif
+
+// Gap between the top of the heap and the stack
+int freeMemory() {
+#if defined(__AVR__)
+    extern int __heap_start;
+    extern int* __brkval;
+    char top;
+    char* heapEnd = __brkval == 0 ? (char*)&__heap_start : (char*)__brkval;
+    return &top - heapEnd;
+#elif defined(__arm__)
+    char top;
+    return &top - sbrk(0);
+#else
+    return -1;
+#endif
+}
+
+void benchMatchers(const __FlashStringHelper* label) {
+    Serial.println(label);
+    benchStage(F("compareSequences"), benchCompare, NULL);
+    benchStage(F("dtwSimilarity"), benchDtw, NULL);
+    benchStage(F("nccSimilarity"), benchNcc, NULL);
+    benchStage(F("computeFeatures"), benchFeatures, NULL);
+}
+
+void runBenchmark() {
+    // Give the host a moment to open the port on native USB boards
+    unsigned long waitStart = millis();
+    while (!Serial && millis() - waitStart < 5000) {
+    }
+    Serial.println(F("Benchmark started"));
+    Serial.print(F("Free SRAM: "));
+    Serial.print(freeMemory());
+    Serial.println(F(" bytes"));
+    Serial.print(F("Capture arena: "));
+    Serial.print((int)sizeof(captureArena));
+    Serial.println(F(" bytes"));
+
+    benchStage(F("takeSample"), benchTakeSample, NULL);
+    filterPrimed = false;
+    benchStage(F("filterSample"), benchFilterSample, NULL);
+    benchStage(F("Serial text sample"), benchLogLine, NULL);
+#if SAMPLE_LOG == SAMPLE_LOG_BINARY
+    benchStage(F("telemetrySample"), benchTelemetrySample, benchPrepareTelemetry);
+    telemetryTail = telemetryHead;
+#endif
+#if USE_RESAMPLING
+    benchStage(F("resampleSequence"), benchResample, benchPrepareResample);
+#endif
+
+    template_t synthetic[TEMPLATE_LENGTH * 3];
+    benchSynthetic(TEMPLATE_LENGTH);
+    encodeSequence((sample_t*)currentSequence, TEMPLATE_LENGTH, synthetic);
+    benchSequence = (sample_t*)currentSequence;
+    benchTemplate = synthetic;
+    benchLength = TEMPLATE_LENGTH;
+    benchPeak = NORM_ONE;
+    benchMatchers(F("Synthetic gesture:"));
+
+    if (templateCount > 0) {
+        // Decoded for the live side, already normalized
+        benchTemplate = (template_t*)storedSequences[0];
+        benchLength = storedLengths[0];
+        for (int i = 0; i < benchLength * 3; i++) {
+            ((sample_t*)currentSequence)[i] = decodeSample(benchTemplate[i]);
+        }
+        benchPeak = NORM_ONE;
+        benchMatchers(F("Enrolled template:"));
+    }
+
+    Serial.print(F("Free SRAM: "));
+    Serial.print(freeMemory());
+    Serial.println(F(" bytes"));
+    Serial.println(F("Benchmark done"));
+}
+#endif
\ No newline at end of file
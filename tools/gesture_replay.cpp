@@ -0,0 +1,565 @@
+// Offline replay of logged captures through the matching core, so tolerances
+// and thresholds can be tuned in seconds instead of one gesture at a time.
+//
+// Build natively from the repository root:
+//   g++ -std=c++11 -O2 -I. -o gesture_replay tools/gesture_replay.cpp
+// Any setting of gesture_match.h or the capture geometry can be overridden
+// the same way as for the board, e.g. -DMATCH_TOLERANCE=0.25,
+// -DUSE_FIXED_POINT=0, -DUSE_RESAMPLING=0 or -DSAMPLE_RATE_HZ=100.
+//
+// Usage: gesture_replay [--roc roc.csv] [--runs N] capture_file...
+// Each file holds captures of one gesture, either a Serial text log
+// (SAMPLE_LOG_TEXT), the binary telemetry stream (SAMPLE_LOG_BINARY) or a
+// batch export (USE_CAPTURE_EXPORT), e.g. as saved from BLE UART.
+// Recordings and unlock attempts alike count as captures. Every ordered pair
+// of different captures is scored with the first as the enrolled template
+// and the second as the attempt: pairs from the same file are genuine,
+// pairs from different files impostors. Each matcher reports throughput,
+// FAR/FRR at MATCH_THRESHOLD and the equal error rate; --roc writes the
+// full FAR/FRR curve as CSV.
+//
+// Pairs are scored against one template each, the building block of the
+// device's best-of-MAX_TEMPLATES decision.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#ifndef SAMPLE_RATE_HZ
+#define SAMPLE_RATE_HZ 50
+#endif
+#ifndef SEQUENCE_LENGTH
+#define SEQUENCE_LENGTH 50
+#endif
+#define SAMPLES_FOR_MS(ms) ((int)((long)(ms) * SAMPLE_RATE_HZ / 1000))
+
+#ifndef USE_RESAMPLING
+#define USE_RESAMPLING 1
+#endif
+#ifndef RESAMPLE_LENGTH
+#define RESAMPLE_LENGTH 32
+#endif
+
+#include "gesture_match.h"
+
+#define TELEMETRY_BEGIN 0x01
+#define TELEMETRY_SAMPLE 0x02
+#define TELEMETRY_END 0x03
+#define EXPORT_BEGIN 0x04
+#define EXPORT_DATA 0x05
+
+#define ROC_STEPS 200  // Thresholds written to the ROC curve, evenly over [0, 1]
+
+struct Capture {
+    int gesture;  // Index of the file it came from
+    std::vector<sample_t> samples;  // [ax,ay,az] per sample, as logged
+    int length() const { return samples.size() / 3; }
+};
+
+std::vector<Capture> captures;
+int skippedCaptures = 0;  // Incomplete or too short to use
+int duplicateCaptures = 0;  // Exported copies of captures the telemetry already had
+
+sample_t sampleFromFloat(double value) {
+#if USE_FIXED_POINT
+    long units = lround(value * (1 << SAMPLE_FRAC_BITS));
+    return units > SAMPLE_MAX ? SAMPLE_MAX : units < -SAMPLE_MAX ? -SAMPLE_MAX : units;
+#else
+    return value;
+#endif
+}
+
+sample_t sampleFromQ78(int16_t value) {
+#if USE_FIXED_POINT
+    return value < -SAMPLE_MAX ? -SAMPLE_MAX : value;
+#else
+    return value / 256.0;
+#endif
+}
+
+// Keeps the first length samples of a finished capture, if that many are there
+void finishCapture(Capture& capture, int length) {
+    if (length >= 0 && length < capture.length()) {
+        capture.samples.resize(length * 3);
+    }
+    if (capture.length() >= 2) {
+        captures.push_back(capture);
+    } else if (capture.length() > 0) {
+        skippedCaptures++;
+    }
+    capture.samples.clear();
+}
+
+// =============== TEXT LOGS =========================
+// "Sample N: X=.. Y=.. Z=.." while recording, "Check Sample N: ..." while
+// checking. A capture ends when the index restarts; a "Collected N samples"
+// line trims the quiet tail the segmenter dropped on the device. Attempts
+// have no such line and keep theirs.
+
+void parseTextLog(FILE* file, int gesture) {
+    Capture capture;
+    capture.gesture = gesture;
+    int lastIndex = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        const char* text = strstr(line, "Sample ");
+        int index;
+        float x, y, z;
+        if (text && sscanf(text, "Sample %d: X=%f Y=%f Z=%f", &index, &x, &y, &z) == 4) {
+            if (index <= lastIndex) {
+                finishCapture(capture, -1);
+            }
+            if (index != capture.length()) {
+                // Gap in the log, nothing to line the rest up against
+                skippedCaptures += capture.length() > 0;
+                capture.samples.clear();
+                lastIndex = index;
+                continue;
+            }
+            capture.samples.push_back(sampleFromFloat(x));
+            capture.samples.push_back(sampleFromFloat(y));
+            capture.samples.push_back(sampleFromFloat(z));
+            lastIndex = index;
+            continue;
+        }
+
+        const char* collected = strstr(line, "Collected ");
+        int count;
+        if (collected && sscanf(collected, "Collected %d samples", &count) == 1) {
+            finishCapture(capture, count);
+            lastIndex = -1;
+        }
+    }
+    finishCapture(capture, -1);
+}
+
+// =============== BINARY TELEMETRY =========================
+// Frames as sent by telemetrySend() and exportSend(): COBS encoded, 0x00
+// delimited, CRC-8 at the end. Status lines printed between frames end up in
+// front of the next one, so a chunk that doesn't decode is retried after each
+// line break. Export frames number their own sequence and carry int8 samples
+// relative to the capture's peak, which are scaled back to Q7.8 here. A
+// device logging both ships every capture twice, so a file's exported
+// captures are only used when it has no telemetry captures; otherwise each
+// would be scored as a perfect genuine match against its own copy.
+
+uint8_t crc8(const uint8_t* data, int length) {
+    uint8_t crc = 0;
+    for (int i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Returns the decoded length, or -1 if chunk isn't a valid frame
+int decodeFrame(const uint8_t* chunk, int length, uint8_t* frame) {
+    int out = 0;
+    int i = 0;
+    while (i < length) {
+        int code = chunk[i++];
+        if (code == 0 || i + code - 1 > length) {
+            return -1;
+        }
+        for (int k = 1; k < code; k++) {
+            frame[out++] = chunk[i++];
+        }
+        if (i < length) {
+            frame[out++] = 0;
+        }
+    }
+    if (out < 4 || crc8(frame, out - 1) != frame[out - 1]) {
+        return -1;
+    }
+    return out - 1;
+}
+
+sample_t sampleFromExport(int8_t value, int16_t peak) {
+#if USE_FIXED_POINT
+    int32_t scaled = (int32_t)value * peak;
+    return (scaled + (scaled < 0 ? -63 : 63)) / 127;
+#else
+    return value * (peak / 256.0) / 127;
+#endif
+}
+
+void parseTelemetry(const std::vector<uint8_t>& data, int gesture) {
+    Capture capture;
+    capture.gesture = gesture;
+    bool inCapture = false;
+    bool complete = true;
+    int expectedSequence = -1;
+    Capture exported;
+    exported.gesture = gesture;
+    bool inExport = false;
+    bool exportComplete = true;
+    int exportCount = 0;
+    int16_t exportPeak = 0;
+    int expectedExportSequence = -1;
+    std::vector<Capture> exports;
+    size_t firstCapture = captures.size();
+    uint8_t frame[256];
+
+    size_t start = 0;
+    for (size_t end = 0; end < data.size(); end++) {
+        if (data[end] != 0) {
+            continue;
+        }
+        int length = -1;
+        for (size_t from = start; from < end && length < 0; from++) {
+            if (from == start || data[from - 1] == '\n') {
+                length = end - from <= sizeof(frame) ? decodeFrame(&data[from], end - from, frame) : -1;
+            }
+        }
+        start = end + 1;
+        if (length < 0) {
+            complete = false;  // Could have been one of ours
+            continue;
+        }
+
+        int sequence = frame[1] | (frame[2] << 8);
+        if (frame[0] == EXPORT_BEGIN || frame[0] == EXPORT_DATA) {
+            if (expectedExportSequence >= 0 && sequence != expectedExportSequence) {
+                exportComplete = false;  // Lost on the way
+            }
+            expectedExportSequence = (sequence + 1) & 0xFFFF;
+        } else {
+            if (expectedSequence >= 0 && sequence != expectedSequence) {
+                complete = false;  // Frames dropped on the device
+            }
+            expectedSequence = (sequence + 1) & 0xFFFF;
+        }
+
+        if (frame[0] == EXPORT_BEGIN && length >= 9) {
+            exported.samples.clear();
+            exportCount = frame[4];
+            exportPeak = (int16_t)(frame[7] | (frame[8] << 8));
+            inExport = true;
+            exportComplete = true;
+        } else if (frame[0] == EXPORT_DATA && inExport && length >= 4) {
+            if (frame[3] != exported.length() || (length - 4) % 3 != 0) {
+                exportComplete = false;
+                continue;
+            }
+            for (int i = 4; i < length; i++) {
+                exported.samples.push_back(sampleFromExport((int8_t)frame[i], exportPeak));
+            }
+            if (exported.length() >= exportCount) {
+                if (exportComplete) {
+                    exported.samples.resize(exportCount * 3);
+                    exports.push_back(exported);
+                    exported.samples.clear();
+                } else {
+                    skippedCaptures++;
+                    exported.samples.clear();
+                }
+                inExport = false;
+            }
+        } else if (frame[0] == TELEMETRY_BEGIN) {
+            capture.samples.clear();
+            inCapture = true;
+            complete = true;
+        } else if (frame[0] == TELEMETRY_SAMPLE && inCapture && length >= 10) {
+            if (frame[3] != capture.length()) {
+                complete = false;  // Decimated or dropped
+                continue;
+            }
+            for (int a = 0; a < 3; a++) {
+                capture.samples.push_back(sampleFromQ78((int16_t)(frame[4 + a * 2] | (frame[5 + a * 2] << 8))));
+            }
+        } else if (frame[0] == TELEMETRY_END && inCapture && length >= 7) {
+            int count = frame[4];
+            if (complete && count <= capture.length()) {
+                finishCapture(capture, count);
+            } else {
+                skippedCaptures += count > 0;
+                capture.samples.clear();
+            }
+            inCapture = false;
+        }
+    }
+
+    if (captures.size() > firstCapture) {
+        duplicateCaptures += exports.size();
+        return;
+    }
+    for (size_t i = 0; i < exports.size(); i++) {
+        finishCapture(exports[i], -1);
+    }
+}
+
+bool loadCaptures(const char* path, int gesture) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + read);
+    }
+
+    // Text logs never contain a zero byte, telemetry ends every frame with one
+    if (!data.empty() && memchr(data.data(), 0, data.size())) {
+        parseTelemetry(data, gesture);
+    } else {
+        rewind(file);
+        parseTextLog(file, gesture);
+    }
+    fclose(file);
+    return true;
+}
+
+// =============== MATCHERS =========================
+// Each capture is prepared once the way the device prepares it: templates
+// trimmed to what the capture buffer holds, resampled if enabled, normalized
+// and summarized; attempts trimmed to the capture target and resampled.
+
+struct Prepared {
+    std::vector<template_t> stored;  // Encoded template
+    sample_t storedPeak;
+    GestureFeatures storedFeatures;
+    std::vector<sample_t> live;  // Attempt, not normalized
+    sample_t livePeak;
+    int liveLength;
+};
+
+sample_t peakOf(const sample_t* sequence, int length) {
+    sample_t peak = 0;
+    for (int i = 0; i < length * 3; i++) {
+        peak = max(peak, (sample_t)(sequence[i] < 0 ? -sequence[i] : sequence[i]));
+    }
+    return peak;
+}
+
+std::vector<Prepared> prepared;
+
+void prepareCaptures() {
+    for (size_t c = 0; c < captures.size(); c++) {
+        Prepared p;
+        int length = min(captures[c].length(), SEQUENCE_LENGTH);
+        const sample_t* samples = captures[c].samples.data();
+        p.storedPeak = peakOf(samples, length);
+        p.livePeak = p.storedPeak;
+#if USE_RESAMPLING
+        p.live.resize(RESAMPLE_LENGTH * 3);
+        resampleSequence(samples, length, p.live.data(), RESAMPLE_LENGTH);
+        p.liveLength = RESAMPLE_LENGTH;
+#else
+        p.live.assign(samples, samples + length * 3);
+        p.liveLength = length;
+#endif
+        std::vector<sample_t> normalized = p.live;
+        normalizeSequence(normalized.data(), p.liveLength, p.storedPeak);
+        p.stored.resize(normalized.size());
+        encodeSequence(normalized.data(), p.liveLength, p.stored.data());
+        computeFeatures(p.storedFeatures, p.stored.data(), p.liveLength, liveScale(NORM_ONE));
+        prepared.push_back(p);
+    }
+}
+
+// Without resampling the device captures only as many samples as the longest
+// template, which for a single template is its own length. Resampled
+// attempts are always exactly as long as the template.
+int liveLengthFor(const Prepared& stored, const Prepared& live, sample_t& peak) {
+    int length = live.liveLength;
+    peak = live.livePeak;
+    int storedLength = stored.stored.size() / 3;
+    if (length > storedLength) {
+        length = storedLength;
+        peak = peakOf(live.live.data(), length);
+    }
+    return length;
+}
+
+// Streaming count of the device: samples past the template don't count and
+// samples that never arrived are misses
+float toleranceScore(Prepared& stored, Prepared& live) {
+    sample_t peak;
+    int length = liveLengthFor(stored, live, peak);
+    int storedLength = stored.stored.size() / 3;
+    float similarity = compareSequences(live.live.data(), stored.stored.data(), length, peak, stored.storedPeak);
+    return similarity * length / storedLength;
+}
+
+int prefilterRejects = 0;
+MatchScratch scratch;  // Shared by the DTW and NCC matchers
+
+float dtwScore(Prepared& stored, Prepared& live) {
+    sample_t peak;
+    int length = liveLengthFor(stored, live, peak);
+    if (peak == 0) {
+        return 0;
+    }
+    GestureFeatures features;
+    computeFeatures(features, live.live.data(), length, liveScale(peak));
+    // Lengths too far apart for the band are left to dtwSimilarity(), which
+    // scores them 0 without a pass, so only the feature gate counts here
+    if (!featuresCompatible(features, stored.storedFeatures)) {
+        prefilterRejects++;
+        return 0;
+    }
+    return dtwSimilarity(live.live.data(), length, stored.stored.data(), stored.stored.size() / 3, peak, stored.storedPeak, scratch.dtw);
+}
+
+float nccScore(Prepared& stored, Prepared& live) {
+    sample_t peak;
+    int length = liveLengthFor(stored, live, peak);
+    if (peak == 0) {
+        return 0;
+    }
+    GestureFeatures features;
+    computeFeatures(features, live.live.data(), length, liveScale(peak));
+    if (!featuresCompatible(features, stored.storedFeatures)) {
+        prefilterRejects++;
+        return 0;
+    }
+    return nccSimilarity(live.live.data(), length, stored.stored.data(), stored.stored.size() / 3, peak, stored.storedPeak, scratch.ncc);
+}
+
+struct Matcher {
+    const char* name;
+    float (*score)(Prepared& stored, Prepared& live);
+};
+
+Matcher matchers[] = {
+    {"tolerance", toleranceScore},
+    {"dtw", dtwScore},
+    {"ncc", nccScore},
+};
+
+// =============== REPORT =========================
+
+// Fraction of impostor scores that would unlock and genuine ones that wouldn't
+void errorRates(const std::vector<float>& genuine, const std::vector<float>& impostor, float threshold, float& far, float& frr) {
+    int accepted = 0;
+    for (size_t i = 0; i < impostor.size(); i++) {
+        accepted += impostor[i] > threshold;
+    }
+    int rejected = 0;
+    for (size_t i = 0; i < genuine.size(); i++) {
+        rejected += genuine[i] <= threshold;
+    }
+    far = impostor.empty() ? 0 : (float)accepted / impostor.size();
+    frr = genuine.empty() ? 0 : (float)rejected / genuine.size();
+}
+
+// Equal error rate, at the threshold on the score grid where FAR and FRR are closest
+float equalErrorRate(const std::vector<float>& genuine, const std::vector<float>& impostor, float& at) {
+    float best = 2;
+    float eer = 1;
+    for (int s = 0; s <= 1000; s++) {
+        float threshold = s / 1000.0;
+        float far, frr;
+        errorRates(genuine, impostor, threshold, far, frr);
+        if (fabs(far - frr) < best) {
+            best = fabs(far - frr);
+            eer = (far + frr) / 2;
+            at = threshold;
+        }
+    }
+    return eer;
+}
+
+int main(int argc, char** argv) {
+    const char* rocPath = NULL;
+    int runs = 1;
+    int gestures = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--roc") && i + 1 < argc) {
+            rocPath = argv[++i];
+        } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            runs = max(1, atoi(argv[++i]));
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [--roc roc.csv] [--runs N] capture_file...\n", argv[0]);
+            return 2;
+        } else if (loadCaptures(argv[i], gestures)) {
+            gestures++;
+        }
+    }
+    if (captures.size() < 2) {
+        fprintf(stderr, "need at least two usable captures\n");
+        return 1;
+    }
+
+    printf("%d captures from %d files (%d skipped, %d duplicates), %s, %s, tolerance %.2f, threshold %.2f\n",
+           (int)captures.size(), gestures, skippedCaptures, duplicateCaptures,
+           USE_FIXED_POINT ? "fixed point" : "float",
+           USE_RESAMPLING ? "resampled" : "captured length",
+           MATCH_TOLERANCE, MATCH_THRESHOLD);
+    prepareCaptures();
+
+    FILE* roc = NULL;
+    if (rocPath) {
+        roc = fopen(rocPath, "w");
+        if (!roc) {
+            perror(rocPath);
+            return 1;
+        }
+        fprintf(roc, "matcher,threshold,far,frr\n");
+    }
+
+    for (size_t m = 0; m < sizeof(matchers) / sizeof(matchers[0]); m++) {
+        std::vector<float> genuine;
+        std::vector<float> impostor;
+        int genuineRejects = 0;
+        clock_t started = clock();
+        for (int run = 0; run < runs; run++) {
+            genuine.clear();
+            impostor.clear();
+            prefilterRejects = 0;
+            genuineRejects = 0;
+            for (size_t s = 0; s < prepared.size(); s++) {
+                for (size_t l = 0; l < prepared.size(); l++) {
+                    if (s == l) {
+                        continue;
+                    }
+                    int rejectsBefore = prefilterRejects;
+                    float similarity = matchers[m].score(prepared[s], prepared[l]);
+                    if (captures[s].gesture == captures[l].gesture) {
+                        genuine.push_back(similarity);
+                        genuineRejects += prefilterRejects - rejectsBefore;
+                    } else {
+                        impostor.push_back(similarity);
+                    }
+                }
+            }
+        }
+        double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+        long pairs = (long)(genuine.size() + impostor.size()) * runs;
+
+        float far, frr, at;
+        errorRates(genuine, impostor, MATCH_THRESHOLD, far, frr);
+        float eer = equalErrorRate(genuine, impostor, at);
+        printf("%-10s %6d genuine %6d impostor  %10.0f pairs/s  FAR %5.2f%%  FRR %5.2f%%  EER %5.2f%% at %.3f\n",
+               matchers[m].name, (int)genuine.size(), (int)impostor.size(),
+               seconds > 0 ? pairs / seconds : 0.0, far * 100, frr * 100, eer * 100, at);
+        if (matchers[m].score == dtwScore || matchers[m].score == nccScore) {
+            printf("%-10s pre-filter rejected %d genuine, %d impostor\n", "",
+                   genuineRejects, prefilterRejects - genuineRejects);
+            if (genuineRejects > 0) {
+                // The gate only exists to save time, so any genuine reject is an FRR regression
+                fprintf(stderr, "warning: %s pre-filter rejects genuine attempts, loosen FEATURE_*_TOLERANCE\n",
+                        matchers[m].name);
+            }
+        }
+
+        if (roc) {
+            for (int s = 0; s <= ROC_STEPS; s++) {
+                float threshold = (float)s / ROC_STEPS;
+                errorRates(genuine, impostor, threshold, far, frr);
+                fprintf(roc, "%s,%.3f,%.4f,%.4f\n", matchers[m].name, threshold, far, frr);
+            }
+        }
+    }
+    if (roc) {
+        fclose(roc);
+    }
+    return 0;
+}